@@ -22,17 +22,14 @@
 
 /* VST architecture for Faust synths. */
 
-/* NOTE: This requires one of the Boost headers (boost/circular_buffer.hpp),
-   so to compile Faust programs created with this architecture you need to
-   have at least the Boost headers installed somewhere on your include path
-   (the Boost libraries aren't needed). */
-
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
 #include <list>
 #include <map>
-#include <set>
 
 // generic Faust dsp and UI classes
 #include <faust/dsp/dsp.h>
@@ -289,8 +286,16 @@ void VSTUI::run() {}
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <boost/circular_buffer.hpp>
+/* Setting FAUST_VST to 0 compiles only the SDK-independent part of the
+   architecture, i.e., the VSTPlugin class which does all the actual MIDI and
+   audio processing, without the VST interface and the GUI. This is used to
+   build the faustvstbench host stub (see 'make bench'), which doesn't need
+   the VST SDK. */
+#ifndef FAUST_VST
+#define FAUST_VST 1
+#endif
 
+#if FAUST_VST
 // Some boilerplate code pilfered from the mda Linux vst source code.
 #include "pluginterfaces/vst2.x/aeffectx.h"
 extern "C" {
@@ -304,6 +309,7 @@ VST_EXPORT AEffect * main(audioMasterCallback audioMaster)
   return VSTPluginMain(audioMaster);
 }
 }
+#endif
 
 /* Setting NVOICES at compile time overrides meta data in the Faust source. If
    set, this must be an integer value >= 0. A nonzero value indicates an
@@ -316,6 +322,191 @@ VST_EXPORT AEffect * main(audioMasterCallback audioMaster)
    range 1..NVOICES. */
 //#define NVOICES 16
 
+/* Dormant voice detection (VSTi only). Once a voice has been released and its
+   output has stayed below VOICE_SILENCE (a level in dB) for at least
+   VOICE_SILENCE_HOLD milliseconds, the voice is considered dormant. Dormant
+   voices are neither computed nor mixed down until they are allocated to a
+   new note again, which saves a lot of cpu time with large polyphony
+   settings. Setting VOICE_SILENCE_HOLD to zero disables this feature, so that
+   all voices are computed in each cycle. */
+#ifndef VOICE_SILENCE
+#define VOICE_SILENCE -90
+#endif
+#ifndef VOICE_SILENCE_HOLD
+#define VOICE_SILENCE_HOLD 100
+#endif
+
+/* Number of threads used to render the voices of an instrument (VSTi only).
+   If this is set to a value N > 1, the plugin runs a pool of N-1 real-time
+   worker threads which compute the voices in parallel with the host's audio
+   thread. Each voice is rendered into its own buffer, and the voices are then
+   mixed down in a fixed order, so the output is exactly the same as with
+   single-threaded processing. Idle workers spin for THREAD_SPINS iterations
+   waiting for the next audio block before they go to sleep. */
+#ifndef NTHREADS
+#define NTHREADS 0
+#endif
+#ifndef THREAD_SPINS
+#define THREAD_SPINS 10000
+#endif
+
+/* This enables sample-accurate processing of MIDI events. Incoming events are
+   queued along with their frame offsets (up to MIDI_QUEUE_SIZE events per
+   cycle), and the voices affected by an event are rendered up to the exact
+   frame at which the event takes effect. If this is disabled, all MIDI events
+   take effect at the beginning of the next audio block. */
+#ifndef FAUST_SAMPLE_ACCURATE
+#define FAUST_SAMPLE_ACCURATE 1
+#endif
+
+/* Incoming MIDI events are passed to the audio thread through a lock-free
+   inbox, which can be written from any thread and holds up to MIDI_QUEUE_SIZE
+   events (this should be a power of 2). The data of sysex messages of up to
+   MIDI_SYSEX_SIZE bytes is kept in a pool of MIDI_SYSEX_BUFFERS preallocated
+   buffers. Events which don't fit into the inbox are dropped and counted (see
+   VSTPlugin::midi_overflows). */
+#ifndef MIDI_QUEUE_SIZE
+#define MIDI_QUEUE_SIZE 1024
+#endif
+#ifndef MIDI_SYSEX_SIZE
+#define MIDI_SYSEX_SIZE 512
+#endif
+#ifndef MIDI_SYSEX_BUFFERS
+#define MIDI_SYSEX_BUFFERS 16
+#endif
+
+/* Hosts often send lots of controller and pitch bend messages in a single
+   block, most of which are superseded by later messages for the same
+   controller on the same MIDI channel. If MIDI_COALESCE is enabled, these are
+   dropped from the event queue before they're processed. Only events at the
+   same frame offset are coalesced, and messages for smoothed controls are
+   left alone, since each of them restarts the ramp, so the output stays the
+   same. This needs sample-accurate processing; without it, MIDI events are
+   processed as soon as they arrive and nothing is coalesced. The dropped
+   events are counted (see VSTPlugin::midi_elided_ctrl). */
+#ifndef MIDI_COALESCE
+#define MIDI_COALESCE 1
+#endif
+
+/* Diagnostic messages (the DEBUG_* output below and a few warnings) are
+   written to a lock-free ring buffer of LOG_RING_SIZE fixed-size records
+   (this should be a power of 2), each consisting of the format string and up
+   to LOG_ARGS arguments. The messages are formatted and printed by a
+   low-priority background thread every LOG_INTERVAL milliseconds, so they can
+   be emitted on the audio thread without risking xruns. Messages which don't
+   fit into the ring are dropped and counted. If FAUST_LOG is disabled,
+   debugging messages are printed right away instead, while the warnings
+   issued on the audio thread are only counted and reported when the plugin
+   is suspended or closed. By default, FAUST_LOG is only enabled in debugging
+   builds, i.e., if any of the DEBUG_* options below or the deadline-miss log
+   of FAUST_XRUN are enabled (but never on Windows), so that regular builds
+   don't start the log thread. */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 4096
+#endif
+#ifndef LOG_ARGS
+#define LOG_ARGS 6
+#endif
+#ifndef LOG_INTERVAL
+#define LOG_INTERVAL 20
+#endif
+
+/* This enables the vectorized mixing kernels (SSE2, AVX2 or NEON, depending
+   on the cpu the plugin runs on) used to mix down the voices of an
+   instrument. Set this to 0 to use the plain scalar code instead, which may
+   be useful for verification purposes. */
+#ifndef FAUST_SIMD
+#define FAUST_SIMD 1
+#endif
+
+/* The dsp instances of a plugin are all allocated in a single contiguous
+   memory area (the arena), each padded to a whole number of cache lines. If
+   FAUST_HUGEPAGES is enabled, we ask the system to back the arena with huge
+   pages (Linux only, this requires transparent huge pages). If FAUST_MLOCK is
+   enabled, the arena is prefaulted and locked into memory when the plugin is
+   activated, so that it won't be paged out. */
+#ifndef FAUST_HUGEPAGES
+#define FAUST_HUGEPAGES 0
+#endif
+#ifndef FAUST_MLOCK
+#define FAUST_MLOCK 1
+#endif
+
+/* Parameter smoothing. Changes of controls with the smooth:ms attribute in
+   the Faust source (e.g., [smooth:20], or [smooth:20 exp] for an exponential
+   rather than a linear ramp) don't take effect immediately, but ramp to the
+   new value over the given number of milliseconds. To these ends, voices with
+   moving controls are rendered in sub-blocks of at most FAUST_SMOOTH_BLOCK
+   samples, which bounds the extra cost; all other voices are rendered in one
+   go as usual. Setting FAUST_SMOOTH to a nonzero number of milliseconds
+   smoothes all continuous controls (sliders and numeric entries, including
+   the freq voice control) which don't have a smooth attribute, using
+   exponential ramps if FAUST_SMOOTH_EXP is set. FAUST_SMOOTH_BLOCK = 0
+   disables this feature. */
+#ifndef FAUST_SMOOTH_BLOCK
+#define FAUST_SMOOTH_BLOCK 32
+#endif
+#ifndef FAUST_SMOOTH
+#define FAUST_SMOOTH 0
+#endif
+#ifndef FAUST_SMOOTH_EXP
+#define FAUST_SMOOTH_EXP 0
+#endif
+
+/* Host display updates. When the passive controls (bargraphs) change by more
+   than DISPLAY_EPSILON (relative to the range of the control), or the plugin
+   changes any other controls by itself, the host is asked to update its
+   display of the plugin parameters, but at most DISPLAY_RATE times per second
+   of audio (i.e., the limit is measured in samples processed, not in wall
+   clock time). Setting DISPLAY_RATE to 0 removes the rate limit. */
+#ifndef DISPLAY_RATE
+#define DISPLAY_RATE 30
+#endif
+#ifndef DISPLAY_EPSILON
+#define DISPLAY_EPSILON 0.001
+#endif
+
+/* CPU load profiling. If FAUST_PROFILE is enabled, the time spent in each
+   cycle of process_audio() is measured and broken down into MIDI handling,
+   control propagation, voice computation, mixdown and passive control
+   updates; the host display updates triggered by the VST wrapper are timed
+   separately. The timings are collected in histograms which can be printed
+   with VSTPlugin::profile_dump(). Also, bargraphs with a profile attribute
+   show profiling data instead of their dsp values: [profile:load] is the cpu
+   load (block time in percent of the block duration, averaged over
+   PROFILE_TIME seconds), [profile:p50], [profile:p99] and [profile:max] are
+   the median, 99th percentile and maximum block time in microseconds. This
+   needs a few clock reads per voice and block, so it's disabled by
+   default. */
+#ifndef FAUST_PROFILE
+#define FAUST_PROFILE 0
+#endif
+#ifndef PROFILE_TIME
+#define PROFILE_TIME 0.5
+#endif
+
+/* Deadline monitoring. If FAUST_XRUN is enabled, the wrapper checks the time
+   processReplacing() takes against the duration of the block and counts the
+   blocks exceeding each of the percentages listed in XRUN_THRESHOLDS. For
+   each block above the first threshold, a record with the context of the
+   block (active voices, MIDI events, voice retriggers, a change of the block
+   size or a block split into chunks) is kept in a ring of the XRUN_HISTORY
+   most recent ones, which can be printed with VSTPlugin::xrun_dump(). Blocks
+   exceeding XRUN_LOG percent are also reported right away through the log
+   (0 disables this). */
+#ifndef FAUST_XRUN
+#define FAUST_XRUN 0
+#endif
+#ifndef XRUN_THRESHOLDS
+#define XRUN_THRESHOLDS 50, 80, 100
+#endif
+#ifndef XRUN_HISTORY
+#define XRUN_HISTORY 32
+#endif
+#ifndef XRUN_LOG
+#define XRUN_LOG 100
+#endif
+
 /* This enables special polyphony/tuning controls on the GUI (VSTi only). */
 #ifndef VOICE_CTRLS
 #define VOICE_CTRLS 1
@@ -365,6 +556,19 @@ VST_EXPORT AEffect * main(audioMasterCallback audioMaster)
 //#define DEBUG_MIDICC 1 // controller messages
 //#define DEBUG_RPN 1 // RPN messages (pitch bend range, master tuning)
 //#define DEBUG_MTS 1 // MTS messages (octave/scale tuning)
+//#define DEBUG_ARENA 1 // size of the dsp arena
+
+// Debugging builds print their messages through the log ring (see FAUST_LOG
+// above).
+#ifndef FAUST_LOG
+#if !defined(_WIN32) && (DEBUG_META || DEBUG_VOICES || DEBUG_VOICE_ALLOC || \
+    DEBUG_MIDI || DEBUG_NOTES || DEBUG_MIDICC || DEBUG_RPN || DEBUG_MTS || \
+    DEBUG_ARENA || (FAUST_XRUN && XRUN_LOG > 0))
+#define FAUST_LOG 1
+#else
+#define FAUST_LOG 0
+#endif
+#endif
 
 // Note and voice data structures.
 
@@ -373,28 +577,520 @@ struct NoteInfo {
   int8_t note;
 };
 
+// MIDI event queued for processing in the audio thread.
+struct MidiEvent {
+  int frame;		// frame offset relative to the start of the block
+  int sysex;		// sysex buffer (see MidiInbox below), -1 if none
+  uint8_t data[4];	// MIDI message (short messages only)
+};
+
+// Bounded lock-free queue with any number of producers and a single
+// consumer. Each slot carries a sequence number which tells whether it's
+// ready to be written or read, so producers only need to claim a slot with an
+// atomic increment of the write position. The capacity is rounded up to the
+// next power of 2. Items which don't fit into the queue are dropped.
+template <typename T>
+struct MpscRing {
+  struct Slot {
+    std::atomic<unsigned> seq;
+    T item;
+  };
+  Slot *slots;
+  unsigned size;
+  std::atomic<unsigned> head;	// write position (producers)
+  unsigned tail;		// read position (consumer)
+  // Number of items which were dropped because the queue was full.
+  std::atomic<unsigned> overflows;
+  MpscRing(unsigned n) : head(0), tail(0), overflows(0)
+  {
+    for (size = 1; size < n; size <<= 1) ;
+    slots = new Slot[size];
+    for (unsigned i = 0; i < size; i++)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+  ~MpscRing()
+  {
+    delete[] slots;
+  }
+  bool push(const T &item)
+  {
+    unsigned pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &s = slots[pos & (size-1)];
+      int d = (int)(s.seq.load(std::memory_order_acquire) - pos);
+      if (d == 0) {
+	if (head.compare_exchange_weak(pos, pos+1,
+				       std::memory_order_relaxed)) {
+	  s.item = item;
+	  s.seq.store(pos+1, std::memory_order_release);
+	  return true;
+	}
+      } else if (d < 0) {
+	// queue full
+	overflows.fetch_add(1, std::memory_order_relaxed);
+	return false;
+      } else
+	pos = head.load(std::memory_order_relaxed);
+    }
+  }
+  bool pop(T &item)
+  {
+    Slot &s = slots[tail & (size-1)];
+    if ((int)(s.seq.load(std::memory_order_acquire) - (tail+1)) < 0)
+      return false;
+    item = s.item;
+    s.seq.store(tail+size, std::memory_order_release);
+    tail++;
+    return true;
+  }
+};
+
+// MIDI event queue, consumed by the audio thread. Sysex messages are stored
+// in a separate pool of buffers, the overflow count also includes sysex
+// messages which were dropped because the pool was full.
+struct MidiInbox : MpscRing<MidiEvent> {
+  struct Sysex {
+    std::atomic<bool> busy;
+    int len;
+    uint8_t data[MIDI_SYSEX_SIZE];
+  };
+  Sysex *sysex;
+  MidiInbox() : MpscRing<MidiEvent>(MIDI_QUEUE_SIZE)
+  {
+    sysex = new Sysex[MIDI_SYSEX_BUFFERS];
+    for (int i = 0; i < MIDI_SYSEX_BUFFERS; i++)
+      sysex[i].busy.store(false, std::memory_order_relaxed);
+  }
+  ~MidiInbox()
+  {
+    delete[] sysex;
+  }
+  // Grab a free sysex buffer and fill it with the given data. Returns the
+  // buffer index, -1 if no buffer is available.
+  int alloc_sysex(const uint8_t *data, int len)
+  {
+    if (len <= MIDI_SYSEX_SIZE)
+      for (int i = 0; i < MIDI_SYSEX_BUFFERS; i++) {
+	bool busy = false;
+	if (!sysex[i].busy.load(std::memory_order_relaxed) &&
+	    sysex[i].busy.compare_exchange_strong(busy, true,
+						  std::memory_order_acquire)) {
+	  memcpy(sysex[i].data, data, len);
+	  sysex[i].len = len;
+	  return i;
+	}
+      }
+    overflows.fetch_add(1, std::memory_order_relaxed);
+    return -1;
+  }
+  void free_sysex(int i)
+  {
+    sysex[i].busy.store(false, std::memory_order_release);
+  }
+};
+
+// Diagnostic messages (see FAUST_LOG above). A log record holds a printf
+// format string and its arguments. The format string and any string
+// arguments are stored as pointers, so they must stay valid until the record
+// has been printed (string literals and control labels are fine).
+
+union LogArg {
+  long i;
+  double d;
+  const char *s;
+};
+
+struct LogRecord {
+  const char *fmt;
+  int nargs;
+  LogArg args[LOG_ARGS];
+};
+
+static inline LogArg log_arg(int x) { LogArg a; a.i = x; return a; }
+static inline LogArg log_arg(unsigned x) { LogArg a; a.i = x; return a; }
+static inline LogArg log_arg(long x) { LogArg a; a.i = x; return a; }
+static inline LogArg log_arg(unsigned long x) { LogArg a; a.i = x; return a; }
+static inline LogArg log_arg(double x) { LogArg a; a.d = x; return a; }
+static inline LogArg log_arg(const char *x) { LogArg a; a.s = x; return a; }
+
+static inline void log_fill(LogRecord &rec) { }
+
+template <typename T, typename... Args>
+static inline void log_fill(LogRecord &rec, T x, Args... args)
+{
+  if (rec.nargs < LOG_ARGS) rec.args[rec.nargs++] = log_arg(x);
+  log_fill(rec, args...);
+}
+
+// Format a log record and print it on the given stream. This understands the
+// usual printf conversions, except for '*' widths; length modifiers are
+// ignored, since integers are always stored as longs.
+static void log_print(const LogRecord &rec, FILE *fp)
+{
+  char out[1024];
+  size_t len = 0;
+  int k = 0;
+  for (const char *p = rec.fmt; *p && len < sizeof(out)-1; ) {
+    if (*p != '%') {
+      out[len++] = *p++;
+      continue;
+    } else if (p[1] == '%') {
+      out[len++] = '%';
+      p += 2;
+      continue;
+    }
+    char spec[32];
+    int n = 0, m = 0;
+    spec[n++] = *p++;
+    while (*p && strchr("-+ #0123456789.", *p) && n < 28)
+      spec[n++] = *p++;
+    while (*p && strchr("hlLqjzt", *p))
+      p++;
+    char conv = *p;
+    if (!conv) break;
+    p++;
+    LogArg a;
+    if (k < rec.nargs)
+      a = rec.args[k++];
+    else
+      a.i = 0;
+    char *buf = out+len;
+    size_t avail = sizeof(out)-len;
+    switch (conv) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      spec[n++] = 'l'; spec[n++] = conv; spec[n] = 0;
+      m = snprintf(buf, avail, spec, a.i);
+      break;
+    case 'c':
+      spec[n++] = conv; spec[n] = 0;
+      m = snprintf(buf, avail, spec, (int)a.i);
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+      spec[n++] = conv; spec[n] = 0;
+      m = snprintf(buf, avail, spec, a.d);
+      break;
+    case 's':
+      spec[n++] = conv; spec[n] = 0;
+      m = snprintf(buf, avail, spec, a.s?a.s:"(null)");
+      break;
+    default:
+      break;
+    }
+    if (m > 0)
+      len += (size_t)m < avail ? m : avail-1;
+  }
+  fwrite(out, 1, len, fp);
+}
+
+#if FAUST_LOG
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// The log ring is drained by the log thread. There's a single ring shared by
+// all plugin instances, which is created along with the first and destroyed
+// along with the last instance (see log_acquire and log_release).
+struct LogRing : MpscRing<LogRecord> {
+  unsigned overflows_seen;
+  std::atomic<bool> quit;
+  pthread_t thread;
+  bool running;
+  LogRing() : MpscRing<LogRecord>(LOG_RING_SIZE), overflows_seen(0),
+	      quit(false)
+  {
+    running = pthread_create(&thread, NULL, run, this) == 0;
+  }
+  ~LogRing()
+  {
+    quit.store(true, std::memory_order_release);
+    if (running)
+      pthread_join(thread, NULL);
+    drain();
+  }
+  // Print all pending records.
+  void drain()
+  {
+    LogRecord rec;
+    bool printed = false;
+    while (pop(rec)) {
+      log_print(rec, stderr);
+      printed = true;
+    }
+    unsigned n = overflows.load(std::memory_order_relaxed);
+    if (n != overflows_seen) {
+      fprintf(stderr, "log overflow (%u messages dropped)\n",
+	      n-overflows_seen);
+      overflows_seen = n;
+      printed = true;
+    }
+    if (printed) fflush(stderr);
+  }
+  static void *run(void *data)
+  {
+    LogRing *ring = (LogRing*)data;
+    // Make sure that we don't inherit real-time scheduling from the thread
+    // which created the ring.
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    while (!ring->quit.load(std::memory_order_acquire)) {
+      ring->drain();
+      usleep(LOG_INTERVAL*1000);
+    }
+    return NULL;
+  }
+};
+
+static std::atomic<LogRing*> log_ring(NULL);
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int log_refs = 0;
+
+static void log_acquire()
+{
+  pthread_mutex_lock(&log_mutex);
+  if (log_refs++ == 0)
+    log_ring.store(new LogRing, std::memory_order_release);
+  pthread_mutex_unlock(&log_mutex);
+}
+
+static void log_release()
+{
+  pthread_mutex_lock(&log_mutex);
+  if (--log_refs == 0) {
+    LogRing *ring = log_ring.exchange(NULL, std::memory_order_acq_rel);
+    delete ring;
+  }
+  pthread_mutex_unlock(&log_mutex);
+}
+#endif
+
+// Emit a diagnostic message. This never blocks or allocates memory if the log
+// ring is enabled, so it's safe to use on the audio thread. A message may
+// consist of several records which are printed in succession.
+template <typename... Args>
+static void logmsg(const char *fmt, Args... args)
+{
+  LogRecord rec;
+  rec.fmt = fmt;
+  rec.nargs = 0;
+  log_fill(rec, args...);
+#if FAUST_LOG
+  LogRing *ring = log_ring.load(std::memory_order_acquire);
+  if (ring) {
+    ring->push(rec);
+    return;
+  }
+#endif
+  log_print(rec, stderr);
+}
+
+// Number of messages suppressed by logmsg_rt (see below).
+static std::atomic<unsigned> log_suppressed(0);
+
+// Same as logmsg, but for messages emitted on the audio thread (or in host
+// callbacks which may run on it) in regular builds. Without the log ring, the
+// message isn't printed but just counted, and the count is reported later by
+// log_report().
+template <typename... Args>
+static void logmsg_rt(const char *fmt, Args... args)
+{
+#if FAUST_LOG
+  if (log_ring.load(std::memory_order_acquire)) {
+    logmsg(fmt, args...);
+    return;
+  }
+#endif
+  log_suppressed.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Report the messages suppressed by logmsg_rt so far. This must only be
+// called from a non-real-time context.
+static void log_report(const char *name)
+{
+  unsigned n = log_suppressed.exchange(0, std::memory_order_relaxed);
+  if (n > 0)
+    fprintf(stderr, "%s: %u diagnostic messages suppressed (build with "
+	    "-DFAUST_LOG=1 to see them)\n", name, n);
+}
+
+// Doubly linked list of voices. The links are stored in arrays indexed by
+// voice number (see VoiceData below), so no memory is allocated when voices
+// are moved around, and all list operations are O(1).
+struct VoiceList {
+  int head, tail;
+  VoiceList() : head(-1), tail(-1) { }
+  bool empty() const { return head < 0; }
+  int front() const { return head; }
+  void clear() { head = tail = -1; }
+};
+
+// Fixed-size set of voices, implemented as a bit set. Like VoiceList, this
+// never allocates any memory after construction.
+struct VoiceSet {
+  int nwords, count;
+  uint64_t *bits;
+  VoiceSet(int n) : nwords((n+63)/64), count(0)
+  {
+    bits = (uint64_t*)calloc(nwords, sizeof(uint64_t));
+    assert(nwords == 0 || bits);
+  }
+  ~VoiceSet() { free(bits); }
+  int size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool contains(int i) const { return (bits[i>>6] >> (i&63)) & 1; }
+  void insert(int i)
+  {
+    if (!contains(i)) {
+      bits[i>>6] |= (uint64_t)1 << (i&63);
+      count++;
+    }
+  }
+  void erase(int i)
+  {
+    if (contains(i)) {
+      bits[i>>6] &= ~((uint64_t)1 << (i&63));
+      count--;
+    }
+  }
+  void clear()
+  {
+    memset(bits, 0, nwords*sizeof(uint64_t));
+    count = 0;
+  }
+  // Return the smallest member >= i, -1 if none.
+  int next(int i) const
+  {
+    int k = i>>6;
+    if (k >= nwords) return -1;
+    uint64_t w = bits[k] & (~(uint64_t)0 << (i&63));
+    while (!w) {
+      if (++k >= nwords) return -1;
+      w = bits[k];
+    }
+    return (k<<6) + __builtin_ctzll(w);
+  }
+};
+
+// Pointers to the voice controls which are set on each note, kept in a packed
+// per-voice table so that we don't have to go through the UI element tables
+// of the voices. These are NULL if the control doesn't exist.
+struct VoiceZones {
+  float *freq, *gain, *gate;
+};
+
+// Aggregation of passive controls across voices (poly attribute).
+enum { POLY_MAX, POLY_SUM, POLY_RMS, POLY_LAST, POLY_NEWEST, POLY_MODES };
+
+// Passive control ports, grouped by aggregation mode.
+struct OutCtrl {
+  int port;		// control port
+  float min;		// minimum value (no active voices)
+  float eps;		// noticeable change (see DISPLAY_EPSILON)
+};
+
 struct VoiceData {
   // Octave tunings (offsets in semitones) per MIDI channel.
   float tuning[16][12];
   // Allocated voices per MIDI channel and note.
   int8_t notes[16][128];
-  // Free and used voices.
+  // Free and used voices. Each voice is on exactly one of these lists at any
+  // time, so they can share the same link arrays.
   int n_free, n_used;
-  boost::circular_buffer<int> free_voices;
-  boost::circular_buffer<int> used_voices;
+  VoiceList free_voices, used_voices;
+  int *next, *prev;
+  // Used voices on each MIDI channel, in the same order as on the used list,
+  // so that channel-specific updates only need to touch these.
+  VoiceList chan_voices[16];
+  int *cnext, *cprev;
   NoteInfo *note_info;
+  VoiceZones *zones;
   // Voices queued for note-offs (zero-length notes).
-  set<int> queued;
+  VoiceSet queued;
   // Last gate value during run() for each voice. We need to keep track of
   // these so that we can force the Faust synth to retrigger a note when
   // needed.
   float *lastgate;
+  // The most recently triggered voice (-1 if none).
+  int last;
+#if VOICE_SILENCE_HOLD > 0
+  // Voice activity. For each released voice, silent counts the number of
+  // samples for which the voice's output has been below the silence
+  // threshold (-1 if the voice is still playing), and dormant indicates that
+  // the voice has been silent long enough so that it can be skipped.
+  int *silent;
+  bool *dormant;
+#endif
   // Current pitch bend and pitch bend range on each MIDI channel, in semitones.
   float bend[16], range[16];
   // Current coarse, fine and total master tuning on each MIDI channel (tuning
   // offset relative to A4 = 440 Hz, in semitones).
   float coarse[16], fine[16], tune[16];
-  VoiceData(int n) : free_voices(n), used_voices(n) { }
+  // Precomputed note frequencies on each MIDI channel (including the octave
+  // and master tunings, but not the pitch bend), and the current pitch bend
+  // as a frequency factor. These are updated whenever the corresponding
+  // tuning or pitch bend data changes, so that no pow() calls are needed when
+  // voices are triggered or retuned.
+  float freqs[16][128], bendf[16];
+  VoiceData(int n) : queued(n)
+  {
+    next = (int*)calloc(n, sizeof(int));
+    prev = (int*)calloc(n, sizeof(int));
+    cnext = (int*)calloc(n, sizeof(int));
+    cprev = (int*)calloc(n, sizeof(int));
+    assert(next && prev && cnext && cprev);
+  }
+  ~VoiceData()
+  {
+    free(next);
+    free(prev);
+    free(cnext);
+    free(cprev);
+  }
+  // List operations.
+  static void push_back(VoiceList &l, int *next, int *prev, int i)
+  {
+    next[i] = -1; prev[i] = l.tail;
+    if (l.tail >= 0)
+      next[l.tail] = i;
+    else
+      l.head = i;
+    l.tail = i;
+  }
+  static void erase(VoiceList &l, int *next, int *prev, int i)
+  {
+    if (prev[i] >= 0)
+      next[prev[i]] = next[i];
+    else
+      l.head = next[i];
+    if (next[i] >= 0)
+      prev[next[i]] = prev[i];
+    else
+      l.tail = prev[i];
+  }
+  void push_back(VoiceList &l, int i) { push_back(l, next, prev, i); }
+  void erase(VoiceList &l, int i) { erase(l, next, prev, i); }
+  void chan_push_back(uint8_t ch, int i)
+  { push_back(chan_voices[ch], cnext, cprev, i); }
+  void chan_erase(uint8_t ch, int i)
+  { erase(chan_voices[ch], cnext, cprev, i); }
+  int pop_front(VoiceList &l)
+  {
+    int i = l.head;
+    erase(l, i);
+    return i;
+  }
+  // Put voices 0..n-1 on the free list and clear the used list.
+  void reset_voices(int n)
+  {
+    free_voices.clear();
+    used_voices.clear();
+    for (int ch = 0; ch < 16; ch++)
+      chan_voices[ch].clear();
+    for (int i = 0; i < n; i++)
+      push_back(free_voices, i);
+    n_free = n;
+    n_used = 0;
+  }
 };
 
 #if FAUST_MTS
@@ -506,27 +1202,598 @@ MTSTunings::MTSTunings(const char *path)
 #endif
 
 #if FAUST_MIDICC
-static float ctrlval(const ui_elem_t &el, uint8_t v)
+// Target of a MIDI controller assignment, with the parameters needed to
+// translate controller values precomputed (see ctrlval below).
+// Kinds of controller assignments: 7 bit controllers (midi:ctrl), 14 bit
+// controller pairs (midi:ctrl14, MSB and LSB are sent on controllers n and
+// n+32), and NRPNs (midi:nrpn, 14 bit values sent with data entry).
+enum { CTRL_CC, CTRL_CC14, CTRL_NRPN };
+
+struct CtrlTarget {
+  int elem, port;	// control element and its port
+  bool toggle;		// button or checkbox
+  int maxval;		// maximum controller value (127 or 16383)
+  float min, max;	// control range
+  float scale;		// (max-min)/(maxval+1)
+  float step;		// stepsize (0 if none)
+};
+
+static void init_ctrl_target(CtrlTarget &t, const ui_elem_t &el, int kind)
+{
+  t.elem = -1; t.port = el.port;
+  t.toggle = el.type == UI_BUTTON || el.type == UI_CHECK_BUTTON;
+  t.maxval = kind == CTRL_CC ? 127 : 16383;
+  t.min = el.min; t.max = el.max;
+  t.scale = (el.max-el.min)/(t.maxval+1);
+  t.step = fabs(el.step);
+}
+
+static float ctrlval(const CtrlTarget &t, int v)
 {
   // Translate the given MIDI controller value to the range and stepsize
   // indicated by the Faust control.
-  switch (el.type) {
-  case UI_BUTTON: case UI_CHECK_BUTTON:
-    return (float)(v>=64);
-  default:
-    /* Continuous controllers. The problem here is that the range 0..127 is
-       not symmetric. We'd like to map 64 to the center of the range
-       (max-min)/2 and at the same time retain the full control range
-       min..max. So let's just pretend that there are 128 controller values
-       and map value 127 to the max value anyway. */
-    if (v==127)
-      return el.max;
-    else
-      // XXXFIXME: We might want to add proper quantization according to
-      // el.step here.
-      return el.min+(el.max-el.min)*v/128;
+  if (t.toggle)
+    return (float)(v>t.maxval/2);
+  /* Continuous controllers. The problem here is that the range 0..127 is
+     not symmetric. We'd like to map 64 to the center of the range
+     (max-min)/2 and at the same time retain the full control range
+     min..max. So let's just pretend that there are 128 controller values
+     and map value 127 to the max value anyway. (Likewise for 14 bit
+     values.) */
+  if (v==t.maxval)
+    return t.max;
+  float val = t.min+t.scale*v;
+  if (t.step > 0.0f) {
+    // Round to the nearest step, relative to the minimum value.
+    val = t.min+t.step*floorf((val-t.min)/t.step+0.5f);
+    if ((t.min <= t.max) ? val > t.max : val < t.max)
+      val = t.max;
+  }
+  return val;
+}
+#endif
+
+#if FAUST_SMOOTH_BLOCK > 0
+// Smoothed controls (see FAUST_SMOOTH above).
+
+struct SmoothCtrl {
+  int elem;		// control element
+  float ms;		// ramp time in milliseconds
+  bool exp;		// exponential rather than linear ramp
+  int len;		// ramp time in samples
+  float d, dblk;	// decay per sample and per sub-block (exponential)
+};
+
+// Ramp state of a smoothed control in a dsp instance.
+struct SmoothState {
+  float cur, target;	// current and target value
+  float inc;		// increment per sample (linear)
+  int left;		// samples left until the target is reached (0 if idle)
+};
+#endif
+
+#if FAUST_PROFILE || FAUST_XRUN
+#include <chrono>
+
+static inline uint64_t clock_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+#if FAUST_PROFILE
+// Profiling (see FAUST_PROFILE above). Each block's processing time is
+// accounted to one of the following phases, PROF_BLOCK is the total.
+enum { PROF_MIDI, PROF_CTRL, PROF_VOICES, PROF_MIX, PROF_OUTPUT, PROF_HOST,
+       PROF_BLOCK, PROF_PHASES };
+
+// Statistics shown on profile bargraphs.
+enum { PROF_LOAD, PROF_P50, PROF_P99, PROF_MAX, PROF_STATS };
+
+// Histogram of times in nsecs. The bins are logarithmic with 8 bins per
+// octave (i.e., a resolution of 12.5%), times below 16 nsecs get a bin of
+// their own. The histogram is only written by the audio thread, so updates
+// are plain relaxed loads and stores, and readers never hold up the writer.
+#define PROF_BINS (16+8*60)
+
+struct ProfHist {
+  std::atomic<uint32_t> bins[PROF_BINS];
+  std::atomic<uint64_t> count, sum, max;
+  static int bin(uint64_t x)
+  {
+    if (x < 16) return x;
+    int e = 63-__builtin_clzll(x);
+    return 16 + (e-4)*8 + ((x>>(e-3))&7);
+  }
+  // Center of bin b.
+  static double value(int b)
+  {
+    if (b < 16) return b;
+    int e = (b-16)/8+4;
+    return (double)((uint64_t)(8+(b-16)%8) << (e-3)) + (1ULL << (e-3))*0.5;
+  }
+  void clear()
+  {
+    for (int b = 0; b < PROF_BINS; b++)
+      bins[b].store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+  void add(uint64_t x)
+  {
+    std::atomic<uint32_t> &b = bins[bin(x)];
+    b.store(b.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+    count.store(count.load(std::memory_order_relaxed)+1,
+		std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed)+x,
+	      std::memory_order_relaxed);
+    if (x > max.load(std::memory_order_relaxed))
+      max.store(x, std::memory_order_relaxed);
+  }
+  // Approximate q-quantile (0 <= q <= 1) of the recorded times.
+  double percentile(double q) const
+  {
+    uint64_t n = 0;
+    for (int b = 0; b < PROF_BINS; b++)
+      n += bins[b].load(std::memory_order_relaxed);
+    if (n == 0) return 0.0;
+    uint64_t k = (uint64_t)ceil(q*n), c = 0;
+    if (k == 0) k = 1;
+    for (int b = 0; b < PROF_BINS; b++) {
+      c += bins[b].load(std::memory_order_relaxed);
+      if (c >= k)
+	return std::min(value(b),
+			(double)max.load(std::memory_order_relaxed));
+    }
+    return (double)max.load(std::memory_order_relaxed);
   }
+};
+#endif
+
+#if FAUST_XRUN
+// Deadline monitoring (see FAUST_XRUN above).
+static const float xrun_pct[] = { XRUN_THRESHOLDS };
+#define XRUN_LEVELS ((int)(sizeof(xrun_pct)/sizeof(xrun_pct[0])))
+
+enum { XRUN_RESIZED = 1, XRUN_SPLIT = 2 };
+static const char *xrun_flag_names[] =
+  { "", ", resized", ", split", ", resized, split" };
+
+// Context of a block above the first threshold. The records are written by
+// the audio thread only. VSTPlugin::xrun_seq is a sequence lock: it holds
+// twice the number of records written, plus 1 while a record is being
+// written, so that readers can detect records which were overwritten while
+// being read.
+struct XrunRecord {
+  std::atomic<uint64_t> block;	// block number
+  std::atomic<float> load;	// processing time (percent of the block)
+  std::atomic<int> blocksz;	// block size
+  std::atomic<int> voices;	// active voices
+  std::atomic<int> events;	// MIDI events
+  std::atomic<int> retrig;	// voice retriggers
+  std::atomic<int> flags;	// XRUN_RESIZED, XRUN_SPLIT
+};
+#endif
+
+// Audio buffers and mixing kernels.
+
+// Allocate an audio buffer suitably aligned for the vectorized kernels.
+static float *alloc_buffer(unsigned n)
+{
+  void *p = NULL;
+#ifdef _WIN32
+  p = _aligned_malloc(n*sizeof(float), 64);
+#else
+  if (posix_memalign(&p, 64, n*sizeof(float))) p = NULL;
+#endif
+  return (float*)p;
 }
+
+static void free_buffer(float *buf)
+{
+#ifdef _WIN32
+  _aligned_free(buf);
+#else
+  free(buf);
+#endif
+}
+
+// Allocate, lock and free the dsp arena (see FAUST_HUGEPAGES and FAUST_MLOCK
+// above).
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if FAUST_HUGEPAGES && defined(__linux__) && defined(MADV_HUGEPAGE)
+#define HUGEPAGE_SIZE (2<<20)
+#endif
+
+static void *alloc_arena(size_t size)
+{
+  void *p = NULL;
+#ifdef _WIN32
+  p = _aligned_malloc(size, 64);
+#elif defined(HUGEPAGE_SIZE)
+  size = (size+HUGEPAGE_SIZE-1)/HUGEPAGE_SIZE*HUGEPAGE_SIZE;
+  if (posix_memalign(&p, HUGEPAGE_SIZE, size)) return NULL;
+  madvise(p, size, MADV_HUGEPAGE);
+#else
+  if (posix_memalign(&p, 64, size)) p = NULL;
+#endif
+  return p;
+}
+
+static void lock_arena(void *p, size_t size)
+{
+#if FAUST_MLOCK && !defined(_WIN32)
+  // Touch all pages, so that they are mapped before we start processing.
+  const size_t pagesz = sysconf(_SC_PAGESIZE);
+  volatile char *c = (volatile char*)p;
+  for (size_t k = 0; k < size; k += pagesz)
+    c[k] = c[k];
+  // This may fail if we're not allowed to lock that much memory, in which
+  // case we just carry on.
+  mlock(p, size);
+#endif
+}
+
+static void free_arena(void *p, size_t size)
+{
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+#if FAUST_MLOCK
+  munlock(p, size);
+#endif
+  free(p);
+#endif
+}
+
+#if FAUST_SIMD
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define MIX_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define MIX_NEON 1
+#endif
+#endif
+
+/* The kernels come in different flavors which are selected at runtime,
+   depending on the capabilities of the cpu. Each flavor provides the
+   following operations:
+
+   - mix(dst, src, nsrc, n, add): Sum up the nsrc <= 4 buffers in src and
+     store the result in dst (add = false), or add it to dst (add = true).
+     The sources are always added from left to right, so that summing up
+     several sources at once yields exactly the same result as adding them
+     one at a time.
+
+   - peak(buf, n): Compute the peak (maximum absolute value) of a buffer.
+
+   The scalar versions serve as the reference implementation. */
+
+struct MixKernels {
+  const char *name;
+  void (*mix)(float *dst, float **src, int nsrc, int n, bool add);
+  float (*peak)(const float *buf, int n);
+};
+
+static void mix_scalar(float *dst, float **src, int nsrc, int n, bool add)
+{
+  int k = 0;
+  if (!add)
+    for (int j = 0; j < n; j++)
+      dst[j] = src[k][j];
+  else
+    for (int j = 0; j < n; j++)
+      dst[j] += src[k][j];
+  for (k = 1; k < nsrc; k++)
+    for (int j = 0; j < n; j++)
+      dst[j] += src[k][j];
+}
+
+static float peak_scalar(const float *buf, int n)
+{
+  float p = 0.0f;
+  for (int j = 0; j < n; j++)
+    if (fabs(buf[j]) > p) p = fabs(buf[j]);
+  return p;
+}
+
+#if MIX_X86
+
+__attribute__((target("sse2")))
+static void mix_sse2(float *dst, float **src, int nsrc, int n, bool add)
+{
+  int j = 0;
+  for (; j+4 <= n; j += 4) {
+    __m128 t = _mm_loadu_ps(src[0]+j);
+    if (add) t = _mm_add_ps(_mm_loadu_ps(dst+j), t);
+    for (int k = 1; k < nsrc; k++)
+      t = _mm_add_ps(t, _mm_loadu_ps(src[k]+j));
+    _mm_storeu_ps(dst+j, t);
+  }
+  for (; j < n; j++) {
+    float t = add?dst[j]+src[0][j]:src[0][j];
+    for (int k = 1; k < nsrc; k++)
+      t += src[k][j];
+    dst[j] = t;
+  }
+}
+
+__attribute__((target("sse2")))
+static float peak_sse2(const float *buf, int n)
+{
+  const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 p = _mm_setzero_ps();
+  int j = 0;
+  for (; j+4 <= n; j += 4)
+    p = _mm_max_ps(p, _mm_and_ps(_mm_loadu_ps(buf+j), mask));
+  float q[4];
+  _mm_storeu_ps(q, p);
+  float r = max(max(q[0], q[1]), max(q[2], q[3]));
+  for (; j < n; j++)
+    if (fabs(buf[j]) > r) r = fabs(buf[j]);
+  return r;
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(float *dst, float **src, int nsrc, int n, bool add)
+{
+  int j = 0;
+  for (; j+8 <= n; j += 8) {
+    __m256 t = _mm256_loadu_ps(src[0]+j);
+    if (add) t = _mm256_add_ps(_mm256_loadu_ps(dst+j), t);
+    for (int k = 1; k < nsrc; k++)
+      t = _mm256_add_ps(t, _mm256_loadu_ps(src[k]+j));
+    _mm256_storeu_ps(dst+j, t);
+  }
+  for (; j < n; j++) {
+    float t = add?dst[j]+src[0][j]:src[0][j];
+    for (int k = 1; k < nsrc; k++)
+      t += src[k][j];
+    dst[j] = t;
+  }
+}
+
+__attribute__((target("avx2")))
+static float peak_avx2(const float *buf, int n)
+{
+  const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 p = _mm256_setzero_ps();
+  int j = 0;
+  for (; j+8 <= n; j += 8)
+    p = _mm256_max_ps(p, _mm256_and_ps(_mm256_loadu_ps(buf+j), mask));
+  float q[8];
+  _mm256_storeu_ps(q, p);
+  float r = 0.0f;
+  for (int k = 0; k < 8; k++)
+    if (q[k] > r) r = q[k];
+  for (; j < n; j++)
+    if (fabs(buf[j]) > r) r = fabs(buf[j]);
+  return r;
+}
+
+#endif
+
+#if MIX_NEON
+
+static void mix_neon(float *dst, float **src, int nsrc, int n, bool add)
+{
+  int j = 0;
+  for (; j+4 <= n; j += 4) {
+    float32x4_t t = vld1q_f32(src[0]+j);
+    if (add) t = vaddq_f32(vld1q_f32(dst+j), t);
+    for (int k = 1; k < nsrc; k++)
+      t = vaddq_f32(t, vld1q_f32(src[k]+j));
+    vst1q_f32(dst+j, t);
+  }
+  for (; j < n; j++) {
+    float t = add?dst[j]+src[0][j]:src[0][j];
+    for (int k = 1; k < nsrc; k++)
+      t += src[k][j];
+    dst[j] = t;
+  }
+}
+
+static float peak_neon(const float *buf, int n)
+{
+  float32x4_t p = vdupq_n_f32(0.0f);
+  int j = 0;
+  for (; j+4 <= n; j += 4)
+    p = vmaxq_f32(p, vabsq_f32(vld1q_f32(buf+j)));
+  float q[4];
+  vst1q_f32(q, p);
+  float r = max(max(q[0], q[1]), max(q[2], q[3]));
+  for (; j < n; j++)
+    if (fabs(buf[j]) > r) r = fabs(buf[j]);
+  return r;
+}
+
+#endif
+
+static const MixKernels *mix_kernels()
+{
+  static const MixKernels scalar = { "scalar", mix_scalar, peak_scalar };
+#if MIX_X86
+  static const MixKernels sse2 = { "sse2", mix_sse2, peak_sse2 };
+  static const MixKernels avx2 = { "avx2", mix_avx2, peak_avx2 };
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return &avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    return &sse2;
+#elif MIX_NEON
+  static const MixKernels neon = { "neon", mix_neon, peak_neon };
+  return &neon;
+#endif
+  return &scalar;
+}
+
+#if NTHREADS > 1
+
+// Thread pool for rendering the voices of an instrument in parallel.
+
+#include <pthread.h>
+#include <sched.h>
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+struct RenderPool {
+  typedef void (*job_t)(void *data, int k);
+  int nworkers;		// number of worker threads
+  pthread_t *workers;	// the worker threads
+  // The current job, which consists of njobs work items 0..njobs-1. The work
+  // counter keeps the job generation in its upper and the number of the next
+  // work item in its lower 32 bits, so that a worker can never pick up an
+  // item of a job which has already been finished.
+  std::atomic<job_t> job;
+  std::atomic<void*> data;
+  std::atomic<int> njobs;
+  std::atomic<uint64_t> work;
+  std::atomic<int> pending;	// number of unfinished work items
+  std::atomic<int> sleepers;	// number of parked workers
+  std::atomic<bool> quit;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Scheduling parameters of the audio thread, adopted by the workers.
+  bool sched_init;
+  std::atomic<int> sched_gen;
+  int policy;
+  struct sched_param param;
+
+  RenderPool(int n);
+  ~RenderPool();
+
+  bool fetch(uint32_t gen, int &k)
+  {
+    uint64_t w = work.load(std::memory_order_acquire);
+    while ((uint32_t)(w>>32) == gen &&
+	   (int)(uint32_t)w < njobs.load(std::memory_order_relaxed)) {
+      if (work.compare_exchange_weak(w, w+1, std::memory_order_acq_rel)) {
+	k = (int)(uint32_t)w;
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void adopt_sched()
+  {
+    // Pass the scheduling parameters of the calling thread (presumably the
+    // host's audio thread) on to the workers.
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0)
+      sched_gen++;
+    sched_init = true;
+  }
+
+  // Run a job, i.e., invoke the given function on all work items 0..n-1.
+  // The calling thread takes part in the computation and only returns after
+  // all work items have been processed.
+  void run(job_t f, void *d, int n)
+  {
+    if (!sched_init) adopt_sched();
+    job.store(f, std::memory_order_relaxed);
+    data.store(d, std::memory_order_relaxed);
+    njobs.store(n, std::memory_order_relaxed);
+    pending.store(n, std::memory_order_relaxed);
+    uint32_t gen = (uint32_t)(work.load(std::memory_order_relaxed)>>32)+1;
+    work.store((uint64_t)gen<<32);
+    if (sleepers.load() > 0) {
+      pthread_mutex_lock(&mutex);
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+    }
+    int k;
+    while (fetch(gen, k)) {
+      f(d, k);
+      pending.fetch_sub(1, std::memory_order_release);
+    }
+    while (pending.load(std::memory_order_acquire) > 0)
+      cpu_relax();
+  }
+
+  static void *worker(void *arg);
+};
+
+RenderPool::RenderPool(int n)
+  : nworkers(0), job(NULL), data(NULL), njobs(0), work(0), pending(0),
+    sleepers(0), quit(false), sched_init(false), sched_gen(0),
+    policy(SCHED_OTHER)
+{
+  memset(&param, 0, sizeof(param));
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+  workers = (pthread_t*)calloc(n, sizeof(pthread_t));
+  assert(n == 0 || workers);
+  for (int i = 0; i < n; i++)
+    if (pthread_create(&workers[nworkers], NULL, worker, this) == 0)
+      nworkers++;
+}
+
+RenderPool::~RenderPool()
+{
+  pthread_mutex_lock(&mutex);
+  quit = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void *RenderPool::worker(void *arg)
+{
+  RenderPool *pool = (RenderPool*)arg;
+  uint32_t gen = 0;
+  int sched_gen = 0;
+  for (;;) {
+    // Wait for the next job. We spin for a while first, so that we can
+    // respond quickly to a new audio block, then park the thread.
+    uint64_t w = pool->work.load(std::memory_order_acquire);
+    for (int spins = 0; (uint32_t)(w>>32) == gen && !pool->quit; spins++) {
+      if (spins < THREAD_SPINS)
+	cpu_relax();
+      else {
+	pthread_mutex_lock(&pool->mutex);
+	pool->sleepers++;
+	while ((uint32_t)(pool->work.load()>>32) == gen && !pool->quit)
+	  pthread_cond_wait(&pool->cond, &pool->mutex);
+	pool->sleepers--;
+	pthread_mutex_unlock(&pool->mutex);
+      }
+      w = pool->work.load(std::memory_order_acquire);
+    }
+    if (pool->quit) break;
+    gen = (uint32_t)(w>>32);
+    if (sched_gen != pool->sched_gen) {
+      sched_gen = pool->sched_gen;
+      pthread_setschedparam(pthread_self(), pool->policy, &pool->param);
+    }
+    int k;
+    while (pool->fetch(gen, k)) {
+      pool->job.load(std::memory_order_relaxed)
+	(pool->data.load(std::memory_order_relaxed), k);
+      pool->pending.fetch_sub(1, std::memory_order_release);
+    }
+  }
+  return NULL;
+}
+
 #endif
 
 /***************************************************************************/
@@ -542,29 +1809,140 @@ struct VSTPlugin {
   const int ndsps;	// number of dsp instances (1 if maxvoices==0)
   int nvoices;		// current number of voices (<= maxvoices)
   bool active;		// activation status
-  bool modified;	// keep track of modified controls
+  bool modified;	// notify the host of modified controls (see DISPLAY_RATE)
   int rate;		// sampling rate
   mydsp **dsp;		// the dsps
   VSTUI **ui;		// their Faust interface descriptions
   int n_in, n_out;	// number of input and output control ports
-  int poly, tuning;	// polyphony and tuning ports
+  // Polyphony and tuning ports. These are shared with the host and GUI
+  // threads. Tuning changes are requested through tuning_req and carried out
+  // on the audio thread (see request_tuning below).
+  std::atomic<int> poly, tuning, tuning_req;
   int *ctrls;		// Faust ui elements (indices into ui->elems)
-  float *ports;		// port data (plugin-side control values)
+  // Port data (plugin-side control values). These are shared with the host
+  // and GUI threads, modified input ports are flagged in the dirty mask.
+  std::atomic<float> *ports;
   float *portvals;	// cached port data from the last run
+  // Bit masks of modified and active control ports, and the list of ports
+  // modified in the current cycle (see mark_dirty and process_block).
+  std::atomic<uint64_t> *dirty;
+  uint64_t *inmask;
+  int n_dirty, *changed;
   float *midivals[16];	// per-channel midi data
   int *inctrls, *outctrls;	// indices for active and passive controls
   int freq, gain, gate;	// indices of voice controls
   const char **units;	// unit names (control meta data)
-  unsigned n_samples;	// current block size
-  float **outbuf;	// audio buffers for mixing down the voices
-  float **inbuf;	// dummy input buffer used for retriggering notes
-  std::map<uint8_t,int> ctrlmap; // MIDI controller map (control meta data)
+  // Passive controls, sorted by aggregation mode; the controls with mode m
+  // are outinfo[outstart[m]..outstart[m+1]-1]. The zones of dsp l are
+  // outzones[l*n_out..(l+1)*n_out-1], in the same order. outvals holds the
+  // aggregated values.
+  OutCtrl *outinfo;
+  int outstart[POLY_MODES+1];
+  float **outzones, *outvals;
+  // Host display updates: pending notification, frames to wait until the
+  // next one, and the passive control values last reported.
+  bool disp_pending;
+  int disp_wait;
+  float *dispvals;
+  int n_samples;		// current block size
+  float ***vbuf;	// per-voice audio buffers for mixing down the voices
+  int *rvoices;		// voices to be rendered in the current cycle
+  float **inbuf, **outbuf; // dummy buffers used for retriggering notes
+  const MixKernels *mixer; // mixing kernels
+#if FAUST_MIDICC
+  // MIDI controller maps (control meta data). The controls assigned to
+  // controller number n are ctrltargets[ctrlmap[n]..ctrlmap[n+1]-1], likewise
+  // for 14 bit controllers (ctrl14map) and NRPNs (nrpnmap, NULL if there are
+  // no NRPN assignments).
+  int ctrlmap[129], ctrl14map[33], *nrpnmap;
+  CtrlTarget *ctrltargets;
+  // Current MSB of each 14 bit controller on each MIDI channel.
+  uint8_t ctrl14_msb[16][32];
+  // Whether an NRPN rather than an RPN is selected on each MIDI channel.
+  bool nrpn[16];
+#endif
+#if FAUST_SMOOTH_BLOCK > 0
+  // Smoothed controls. smoothidx maps each control element to its index in
+  // smoothctrls (-1 if the control isn't smoothed). The ramp states of dsp l
+  // are smooth[l*n_smooth..(l+1)*n_smooth-1], nmoving[l] is the number of
+  // these which are currently moving. If smooth_jump is set, new control
+  // values are applied immediately (first cycle after activation).
+  int n_smooth;
+  int *smoothidx;
+  SmoothCtrl *smoothctrls;
+  SmoothState *smooth;
+  int *nmoving;
+  bool smooth_jump;
+#endif
   // Current RPN MSB and LSB numbers, as set with controllers 101 and 100.
   uint8_t rpn_msb[16], rpn_lsb[16];
   // Current data entry MSB and LSB numbers, as set with controllers 6 and 38.
   uint8_t data_msb[16], data_lsb[16];
   // Synth voice data (instruments only).
   VoiceData *vd;
+  // Memory area holding the dsp instances.
+  char *arena;
+  size_t arena_size, dsp_size;
+  // Rendering state of the current block. While the block is being
+  // rendered, cur_frame is the frame offset at which MIDI events currently
+  // take effect, and for each dsp, vpos is the number of frames rendered so
+  // far and vstart the frame at which rendering started (-1 if none).
+  bool rendering;
+  int cur_frame, cur_blocksz;
+  float **cur_inputs, **cur_outputs;
+  int *vpos, *vstart;
+  float **iptr, **optr;	// per-dsp pointers into the audio buffers
+  float **chunk_inputs, **chunk_outputs; // see process_audio
+  MidiInbox *inbox;	// incoming MIDI events
+#if DEBUG_MIDI
+  unsigned midi_overflows_seen;
+#endif
+#if FAUST_SAMPLE_ACCURATE
+  // MIDI events queued for the next block, sorted by frame offsets, and the
+  // position of the next event to be processed in the current block.
+  MidiEvent *events;
+  int n_events, ev_pos;
+#if MIDI_COALESCE
+  // Bookkeeping for coalesce_midi (see below). These hold sequence numbers of
+  // events, which keep increasing from block to block, so that the tables
+  // never need to be cleared.
+  unsigned ev_seq;
+  unsigned last_ctrl[16][128], last_bend[16];
+  unsigned chan_barrier[16], data_barrier[16];
+  // Controllers (and pitch bend) which drive smoothed controls and thus are
+  // never coalesced.
+  bool keep_ctrl[128], keep_bend;
+  // Number of events elided so far, see midi_elided_ctrl/bend().
+  std::atomic<unsigned> elided_ctrl, elided_bend;
+#endif
+#endif
+#if FAUST_PROFILE
+  // Profiling data: histograms for each phase, the current phase, the time
+  // at which it started, and the time spent in each phase so far in the
+  // current block. Profile bargraphs are stored as pairs of an index into
+  // outinfo and a statistic. The remaining fields are shared with other
+  // threads, see profile_load() and profile_dump().
+  ProfHist *prof;
+  int prof_phase;
+  uint64_t prof_start, prof_mark, prof_acc[PROF_PHASES];
+  int n_prof, *profctrls;
+  std::atomic<float> prof_load;
+  std::atomic<bool> prof_reset;
+#endif
+#if FAUST_XRUN
+  // Deadline monitoring. The context of the current block is collected in
+  // xrun_voices, xrun_events, xrun_retrig and xrun_flags. The counters and
+  // the ring of records may be read by other threads, see xrun_dump().
+  int xrun_voices, xrun_events, xrun_retrig, xrun_flags;
+  std::atomic<uint64_t> xrun_blocks, xrun_counts[XRUN_LEVELS], xrun_seq,
+    xrun_first;
+  XrunRecord *xrun_log;
+  std::atomic<bool> xrun_reset;
+#endif
+#if NTHREADS > 1
+  // Worker threads for parallel rendering.
+  RenderPool *pool;
+#endif
 
   // Static methods. These all use static data so they can be invoked before
   // instantiating a plugin.
@@ -702,6 +2080,10 @@ struct VSTPlugin {
     : maxvoices(num_voices), ndsps(num_voices<=0?1:num_voices),
       vd(num_voices>0?new VoiceData(num_voices):0)
   {
+#if FAUST_LOG
+    // Start the log thread, shared by all plugin instances.
+    log_acquire();
+#endif
     // Initialize static data.
     init_meta();
 #if FAUST_MTS
@@ -716,47 +2098,122 @@ struct VSTPlugin {
       vd->note_info = (NoteInfo*)calloc(ndsps, sizeof(NoteInfo));
       vd->lastgate = (float*)calloc(ndsps, sizeof(float));
       assert(vd->note_info && vd->lastgate);
+#if VOICE_SILENCE_HOLD > 0
+      vd->silent = (int*)calloc(ndsps, sizeof(int));
+      vd->dormant = (bool*)calloc(ndsps, sizeof(bool));
+      assert(vd->silent && vd->dormant);
+#endif
     }
     active = modified = false;
+    disp_pending = true;
+    disp_wait = 0;
     rate = sr;
     nvoices = maxvoices;
     n_in = n_out = 0;
     poly = maxvoices/2;
     tuning = 0;
+    tuning_req = -1;
     freq = gain = gate = -1;
     for (int i = 0; i < 16; i++) {
       rpn_msb[i] = rpn_lsb[i] = 0x7f;
       data_msb[i] = data_lsb[i] = 0;
     }
     if (vd) {
-      vd->n_free = maxvoices;
-      for (int i = 0; i < maxvoices; i++) {
-	vd->free_voices.push_back(i);
+      vd->reset_voices(maxvoices);
+      for (int i = 0; i < maxvoices; i++)
 	vd->lastgate[i] = 0.0f;
-      }
+      vd->last = -1;
       for (int i = 0; i < 16; i++) {
 	vd->bend[i] = 0.0f;
 	vd->range[i] = 2.0f;
 	vd->coarse[i] = vd->fine[i] = vd->tune[i] = 0.0f;
 	for (int j = 0; j < 12; j++)
 	  vd->tuning[i][j] = 0.0f;
+	update_pitch(i);
+	vd->bendf[i] = 1.0f;
       }
-      vd->n_used = 0;
       memset(vd->notes, 0xff, sizeof(vd->notes));
     }
     n_samples = 0;
+    inbox = new MidiInbox;
+#if DEBUG_MIDI
+    midi_overflows_seen = 0;
+#endif
+    rendering = false;
+    cur_frame = cur_blocksz = 0;
+    cur_inputs = cur_outputs = NULL;
+#if FAUST_SAMPLE_ACCURATE
+    events = (MidiEvent*)calloc(MIDI_QUEUE_SIZE, sizeof(MidiEvent));
+    assert(events);
+    n_events = ev_pos = 0;
+#if MIDI_COALESCE
+    ev_seq = 0;
+    memset(last_ctrl, 0, sizeof(last_ctrl));
+    memset(last_bend, 0, sizeof(last_bend));
+    memset(chan_barrier, 0, sizeof(chan_barrier));
+    memset(data_barrier, 0, sizeof(data_barrier));
+    elided_ctrl = elided_bend = 0;
+#endif
+#endif
+#if FAUST_PROFILE
+    prof = new ProfHist[PROF_PHASES];
+    for (int i = 0; i < PROF_PHASES; i++)
+      prof[i].clear();
+    prof_phase = PROF_MIDI;
+    prof_start = prof_mark = 0;
+    memset(prof_acc, 0, sizeof(prof_acc));
+    n_prof = 0;
+    profctrls = NULL;
+    prof_load = 0.0f;
+    prof_reset = false;
+#endif
+#if FAUST_XRUN
+    xrun_voices = xrun_events = xrun_retrig = xrun_flags = 0;
+    xrun_blocks = xrun_seq = xrun_first = 0;
+    for (int i = 0; i < XRUN_LEVELS; i++)
+      xrun_counts[i] = 0;
+    xrun_log = new XrunRecord[XRUN_HISTORY];
+    xrun_reset = false;
+#endif
+#if NTHREADS > 1
+    pool = NULL;
+#endif
     ctrls = inctrls = outctrls = NULL;
+    vbuf = NULL;
+    rvoices = NULL;
     inbuf = outbuf = NULL;
-    ports = portvals = NULL;
+    mixer = mix_kernels();
+    ports = NULL;
+    portvals = NULL;
+    dirty = NULL;
+    inmask = NULL;
+    changed = NULL;
     units = NULL;
+    dispvals = NULL;
+    outinfo = NULL;
+    outzones = NULL;
+    outvals = NULL;
     memset(midivals, 0, sizeof(midivals));
-    // Initialize the Faust DSPs.
+    // Initialize the Faust DSPs. These are allocated in one contiguous arena,
+    // each instance aligned to a cache line.
+    dsp_size = (sizeof(mydsp)+63)/64*64;
+    arena_size = ndsps*dsp_size;
+    arena = (char*)alloc_arena(arena_size);
+    assert(arena);
+#if DEBUG_ARENA
+    logmsg("%s: dsp arena: %lu bytes (%d x %lu bytes)\n",
+	   pluginName(), (unsigned long)arena_size, ndsps,
+	   (unsigned long)dsp_size);
+#endif
     for (int i = 0; i < ndsps; i++) {
-      dsp[i] = new mydsp();
+      dsp[i] = new (arena+i*dsp_size) mydsp();
       ui[i] = new VSTUI(num_voices);
       dsp[i]->init(rate);
       dsp[i]->buildUserInterface(ui[i]);
     }
+    vpos = (int*)calloc(ndsps, sizeof(int));
+    vstart = (int*)calloc(ndsps, sizeof(int));
+    assert(vpos && vstart);
     // The ports are numbered as follows: 0..k-1 are the control ports, then
     // come the n audio input ports, then the m audio output ports, and
     // finally the midi input port and the polyphony and tuning controls. This
@@ -764,21 +2221,45 @@ struct VSTPlugin {
     // kinds of plugin architectures as well.
     int k = ui[0]->nports, p = 0, q = 0;
     int n = dsp[0]->getNumInputs(), m = dsp[0]->getNumOutputs();
+    iptr = (float**)calloc(ndsps*n, sizeof(float*));
+    optr = (float**)calloc(ndsps*m, sizeof(float*));
+    chunk_inputs = (float**)calloc(n, sizeof(float*));
+    chunk_outputs = (float**)calloc(m, sizeof(float*));
+    assert((n == 0 || (iptr && chunk_inputs)) &&
+	   (m == 0 || (optr && chunk_outputs)));
     // Allocate tables for the built-in control elements and their ports.
     ctrls = (int*)calloc(k, sizeof(int));
     inctrls = (int*)calloc(k, sizeof(int));
     outctrls = (int*)calloc(k, sizeof(int));
-    ports = (float*)calloc(k, sizeof(float));
+    ports = new std::atomic<float>[k]();
     portvals = (float*)calloc(k, sizeof(float));
     units = (const char**)calloc(k, sizeof(const char*));
+    n_dirty = (k+63)/64;
+    dirty = new std::atomic<uint64_t>[n_dirty];
+    inmask = (uint64_t*)calloc(n_dirty, sizeof(uint64_t));
+    changed = (int*)calloc(k, sizeof(int));
+    dispvals = (float*)calloc(k, sizeof(float));
     assert(k == 0 || (ctrls && inctrls && outctrls &&
-		      ports && portvals && units));
+		      portvals && units && inmask && changed && dispvals));
+    for (int w = 0; w < n_dirty; w++)
+      dirty[w] = 0;
     for (int ch = 0; ch < 16; ch++) {
       midivals[ch] = (float*)calloc(k, sizeof(float));
       assert(k == 0 || midivals[ch]);
     }
     // Scan the Faust UI for active and passive controls which become the
     // input and output control ports of the plugin, respectively.
+    int *outmodes = (int*)calloc(k, sizeof(int));
+    assert(k == 0 || outmodes);
+#if FAUST_PROFILE
+    // profile statistics of passive controls (-1 if none)
+    int *outprof = (int*)calloc(k, sizeof(int));
+    assert(k == 0 || outprof);
+#endif
+#if FAUST_MIDICC
+    // controller assignments (kind, number, control)
+    int *ccs = NULL, n_ccs = 0, n_nrpns = 0;
+#endif
     for (int i = 0, j = 0; i < ui[0]->nelems; i++) {
       const char *unit = NULL;
       switch (ui[0]->elems[i].type) {
@@ -790,6 +2271,10 @@ struct VSTPlugin {
 	ctrls[j++] = i;
 	outctrls[q++] = i;
 	{
+	  int mode = POLY_MAX;
+#if FAUST_PROFILE
+	  int stat = -1;
+#endif
 	  std::map< int, list<strpair> >::iterator it =
 	    ui[0]->metadata.find(i);
 	  if (it != ui[0]->metadata.end()) {
@@ -797,15 +2282,34 @@ struct VSTPlugin {
 		 jt != it->second.end(); jt++) {
 	      const char *key = jt->first, *val = jt->second;
 #if DEBUG_META
-	      fprintf(stderr, "ctrl '%s' meta: '%s' -> '%s'\n",
-		      ui[0]->elems[i].label, key, val);
+	      logmsg("ctrl '%s' meta: '%s' -> '%s'\n",
+		     ui[0]->elems[i].label, key, val);
 #endif
 	      if (strcmp(key, "unit") == 0)
 		unit = val;
+	      else if (strcmp(key, "poly") == 0) {
+		static const char *modes[POLY_MODES] =
+		  { "max", "sum", "rms", "last", "newest" };
+		for (int m = 0; m < POLY_MODES; m++)
+		  if (strcmp(val, modes[m]) == 0) mode = m;
+	      }
+#if FAUST_PROFILE
+	      else if (strcmp(key, "profile") == 0) {
+		static const char *stats[PROF_STATS] =
+		  { "load", "p50", "p99", "max" };
+		for (int m = 0; m < PROF_STATS; m++)
+		  if (strcmp(val, stats[m]) == 0) stat = m;
+	      }
+#endif
 	    }
 	  }
 	  int p = ui[0]->elems[i].port;
 	  units[p] = unit;
+	  outmodes[q-1] = mode;
+#if FAUST_PROFILE
+	  outprof[q-1] = stat;
+	  if (stat >= 0) n_prof++;
+#endif
 	}
 	break;
       default:
@@ -831,21 +2335,41 @@ struct VSTPlugin {
 		 jt != it->second.end(); jt++) {
 	      const char *key = jt->first, *val = jt->second;
 #if DEBUG_META
-	      fprintf(stderr, "ctrl '%s' meta: '%s' -> '%s'\n",
-		      ui[0]->elems[i].label, key, val);
+	      logmsg("ctrl '%s' meta: '%s' -> '%s'\n",
+		     ui[0]->elems[i].label, key, val);
 #endif
 	      if (strcmp(key, "unit") == 0) {
 		unit = val;
 #if FAUST_MIDICC
 	      } else if (strcmp(key, "midi") == 0) {
 		unsigned num;
-		if (sscanf(val, "ctrl %u", &num) < 1) continue;
+		int kind;
+		if (sscanf(val, "ctrl14 %u", &num) == 1) {
+		  // 14 bit controller pairs only exist for controllers 0..31,
+		  // 6 is data entry
+		  if (num > 31 || num == 6) continue;
+		  kind = CTRL_CC14;
+		} else if (sscanf(val, "nrpn %u", &num) == 1) {
+		  if (num > 16383) continue;
+		  kind = CTRL_NRPN;
+		  n_nrpns++;
+		} else if (sscanf(val, "ctrl %u", &num) == 1) {
+		  if (num > 127) continue;
+		  kind = CTRL_CC;
+		} else
+		  continue;
 #if 0 // enable this to get feedback about controller assignments
 		const char *dsp_name = pluginName();
-		fprintf(stderr, "%s: cc %d -> %s\n", dsp_name, num,
-			ui[0]->elems[i].label);
+		logmsg("%s: cc %d -> %s\n", dsp_name, num,
+		       ui[0]->elems[i].label);
 #endif
-		ctrlmap.insert(std::pair<uint8_t,int>(num, p));
+		// record the assignment, the controller map is built below
+		ccs = (int*)realloc(ccs, 3*(n_ccs+1)*sizeof(int));
+		assert(ccs);
+		ccs[3*n_ccs] = kind;
+		ccs[3*n_ccs+1] = num;
+		ccs[3*n_ccs+2] = i;
+		n_ccs++;
 #endif
 	      }
 	    }
@@ -855,6 +2379,7 @@ struct VSTPlugin {
 	  int p = ui[0]->elems[i].port;
 	  float val = ui[0]->elems[i].init;
 	  assert(p>=0);
+	  inmask[p>>6] |= (uint64_t)1 << (p&63);
 	  portvals[p] = ports[p] = val;
 	  units[p] = unit;
 	  for (int ch = 0; ch < 16; ch++)
@@ -863,49 +2388,282 @@ struct VSTPlugin {
 	break;
       }
     }
+#if FAUST_MIDICC
+    // Build the MIDI controller maps.
+    ctrltargets = (CtrlTarget*)calloc(n_ccs, sizeof(CtrlTarget));
+    assert(n_ccs == 0 || ctrltargets);
+    int n_targets = build_ctrlmap(ctrlmap, 128, CTRL_CC, ccs, n_ccs, 0);
+    n_targets = build_ctrlmap(ctrl14map, 32, CTRL_CC14, ccs, n_ccs,
+			      n_targets);
+    nrpnmap = NULL;
+    if (n_nrpns > 0) {
+      nrpnmap = (int*)calloc(16385, sizeof(int));
+      assert(nrpnmap);
+      n_targets = build_ctrlmap(nrpnmap, 16384, CTRL_NRPN, ccs, n_ccs,
+				n_targets);
+    }
+    assert(n_targets == n_ccs);
+    free(ccs);
+    memset(ctrl14_msb, 0, sizeof(ctrl14_msb));
+    memset(nrpn, 0, sizeof(nrpn));
+#endif
+#if FAUST_SMOOTH_BLOCK > 0
+    // Collect the smoothed controls.
+    smoothidx = (int*)calloc(ui[0]->nelems, sizeof(int));
+    smoothctrls = (SmoothCtrl*)calloc(p+1, sizeof(SmoothCtrl));
+    assert(ui[0]->nelems == 0 || smoothidx);
+    assert(smoothctrls);
+    n_smooth = 0;
+    for (int idx = 0; idx <= p; idx++) {
+      // the active controls and the freq voice control are candidates
+      int i = idx < p ? inctrls[idx] : freq;
+      if (i < 0) continue;
+      int type = ui[0]->elems[i].type;
+      float ms = 0.0f;
+      bool exp = FAUST_SMOOTH_EXP;
+      if (type == UI_H_SLIDER || type == UI_V_SLIDER || type == UI_NUM_ENTRY)
+	ms = FAUST_SMOOTH;
+      std::map< int, list<strpair> >::iterator it =
+	ui[0]->metadata.find(i);
+      if (it != ui[0]->metadata.end()) {
+	for (std::list<strpair>::iterator jt = it->second.begin();
+	     jt != it->second.end(); jt++) {
+	  const char *key = jt->first, *val = jt->second;
+	  char mode[8] = "";
+	  if (strcmp(key, "smooth") == 0 &&
+	      sscanf(val, "%f %7s", &ms, mode) >= 1) {
+	    if (strcmp(mode, "exp") == 0)
+	      exp = true;
+	    else if (strcmp(mode, "lin") == 0)
+	      exp = false;
+	  }
+	}
+      }
+      if (ms <= 0.0f) continue;
+      SmoothCtrl &c = smoothctrls[n_smooth];
+      c.elem = i;
+      c.ms = ms;
+      c.exp = exp;
+      n_smooth++;
+    }
+    for (int i = 0; i < ui[0]->nelems; i++)
+      smoothidx[i] = -1;
+    for (int s = 0; s < n_smooth; s++)
+      smoothidx[smoothctrls[s].elem] = s;
+    smooth = (SmoothState*)calloc(ndsps*n_smooth, sizeof(SmoothState));
+    nmoving = (int*)calloc(ndsps, sizeof(int));
+    assert((n_smooth == 0 || smooth) && nmoving);
+    smooth_jump = true;
+    init_smooth();
+#endif
+#if FAUST_SAMPLE_ACCURATE && MIDI_COALESCE
+    // Find the controllers which drive smoothed controls. Data entry may also
+    // change the tuning (and thus the freq control) or a smoothed NRPN.
+    memset(keep_ctrl, 0, sizeof(keep_ctrl));
+    keep_bend = false;
+#if FAUST_SMOOTH_BLOCK > 0
+    keep_bend = freq >= 0 && smoothidx[freq] >= 0;
+    keep_ctrl[6] = keep_ctrl[38] = keep_bend;
+#if FAUST_MIDICC
+    for (int num = 0; num < 128; num++) {
+      for (int t = ctrlmap[num]; t < ctrlmap[num+1]; t++)
+	if (smoothidx[ctrltargets[t].elem] >= 0)
+	  keep_ctrl[num] = true;
+      if (num < 64)
+	for (int t = ctrl14map[num&31]; t < ctrl14map[(num&31)+1]; t++)
+	  if (smoothidx[ctrltargets[t].elem] >= 0)
+	    keep_ctrl[num] = true;
+    }
+    if (nrpnmap)
+      for (int t = nrpnmap[0]; t < nrpnmap[16384]; t++)
+	if (smoothidx[ctrltargets[t].elem] >= 0)
+	  keep_ctrl[6] = keep_ctrl[38] = true;
+#endif
+#endif
+#endif
     // Realloc the inctrls and outctrls vectors to their appropriate sizes.
     inctrls = (int*)realloc(inctrls, p*sizeof(int));
     assert(p == 0 || inctrls);
     outctrls = (int*)realloc(outctrls, q*sizeof(int));
     assert(q == 0 || outctrls);
     n_in = p; n_out = q;
+    // Initialize the passive control table, grouping the controls by
+    // aggregation mode.
+    outinfo = (OutCtrl*)calloc(q, sizeof(OutCtrl));
+    outzones = (float**)calloc(ndsps*q, sizeof(float*));
+    outvals = (float*)calloc(q, sizeof(float));
+    assert(q == 0 || (outinfo && outzones && outvals));
+#if FAUST_PROFILE
+    profctrls = (int*)calloc(2*n_prof, sizeof(int));
+    assert(n_prof == 0 || profctrls);
+    int s = 0;
+#endif
+    for (int mode = 0, r = 0; mode < POLY_MODES; mode++) {
+      outstart[mode] = r;
+      for (int idx = 0; idx < q; idx++) {
+	if (outmodes[idx] != mode) continue;
+	const ui_elem_t &el = ui[0]->elems[outctrls[idx]];
+	outinfo[r].port = el.port;
+	outinfo[r].min = el.min;
+	outinfo[r].eps = DISPLAY_EPSILON*fabs(el.max-el.min);
+	for (int l = 0; l < ndsps; l++)
+	  outzones[l*q+r] = ui[l]->elems[outctrls[idx]].zone;
+#if FAUST_PROFILE
+	if (outprof[idx] >= 0) {
+	  profctrls[2*s] = r;
+	  profctrls[2*s+1] = outprof[idx];
+	  s++;
+	}
+#endif
+	r++;
+      }
+    }
+    outstart[POLY_MODES] = q;
+    free(outmodes);
+#if FAUST_PROFILE
+    free(outprof);
+#endif
     if (maxvoices > 0) {
-      // Initialize the mixdown buffer.
-      outbuf = (float**)calloc(m, sizeof(float*));
-      assert(m == 0 || outbuf);
-      // We start out with a blocksize of 512 samples here. Hopefully this is
-      // enough for most realtime hosts so that we can avoid reallocations
-      // later when we know what the actual blocksize is.
+      // Initialize the voice control table.
+      vd->zones = (VoiceZones*)calloc(ndsps, sizeof(VoiceZones));
+      assert(vd->zones);
+      for (int l = 0; l < ndsps; l++) {
+	VoiceZones &z = vd->zones[l];
+	z.freq = freq >= 0 ? ui[l]->elems[freq].zone : NULL;
+	z.gain = gain >= 0 ? ui[l]->elems[gain].zone : NULL;
+	z.gate = gate >= 0 ? ui[l]->elems[gate].zone : NULL;
+      }
+      // Initialize the voice buffers. Each voice is rendered into its own
+      // buffer, and the voices are mixed down in voice order at the end of
+      // each block. We start out with a blocksize of 512 samples here, until
+      // the host tells us the actual maximum blocksize (see set_blocksize
+      // below).
       n_samples = 512;
-      for (int i = 0; i < m; i++) {
-	outbuf[i] = (float*)malloc(n_samples*sizeof(float));
-	assert(outbuf[i]);
+      vbuf = (float***)calloc(ndsps, sizeof(float**));
+      rvoices = (int*)calloc(ndsps, sizeof(int));
+      assert(vbuf && rvoices);
+      for (int l = 0; l < ndsps; l++) {
+	vbuf[l] = (float**)calloc(m, sizeof(float*));
+	assert(m == 0 || vbuf[l]);
+	for (int i = 0; i < m; i++) {
+	  vbuf[l][i] = alloc_buffer(n_samples);
+	  assert(vbuf[l][i]);
+	}
       }
-      // Initialize a 1-sample dummy input buffer used for retriggering notes.
+#if NTHREADS > 1
+      // Initialize the worker threads.
+      if (maxvoices > 1)
+	pool = new RenderPool(min(NTHREADS, maxvoices)-1);
+#endif
+      // Initialize 1-sample dummy buffers used for retriggering notes.
       inbuf = (float**)calloc(n, sizeof(float*));
       assert(n == 0 || inbuf);
-      for (int i = 0; i < m; i++) {
+      for (int i = 0; i < n; i++) {
 	inbuf[i] = (float*)malloc(sizeof(float));
 	assert(inbuf[i]);
 	*inbuf[i] = 0.0f;
       }
+      outbuf = (float**)calloc(m, sizeof(float*));
+      assert(m == 0 || outbuf);
+      for (int i = 0; i < m; i++) {
+	outbuf[i] = (float*)malloc(sizeof(float));
+	assert(outbuf[i]);
+      }
     }
   }
 
+#if FAUST_MIDICC
+  // Fill in a controller map with the assignments of the given kind, in
+  // declaration order, starting at the given position in ctrltargets. A
+  // controller may be assigned to any number of controls. Returns the
+  // position after the last target.
+  int build_ctrlmap(int *map, int n, int kind, const int *ccs, int n_ccs,
+		    int pos)
+  {
+    memset(map, 0, (n+1)*sizeof(int));
+    for (int c = 0; c < n_ccs; c++)
+      if (ccs[3*c] == kind) map[ccs[3*c+1]+1]++;
+    map[0] = pos;
+    for (int num = 0; num < n; num++)
+      map[num+1] += map[num];
+    // map[num] is the start of each range now, use these as fill pointers
+    for (int c = 0; c < n_ccs; c++)
+      if (ccs[3*c] == kind) {
+	int num = ccs[3*c+1], i = ccs[3*c+2];
+	CtrlTarget &t = ctrltargets[map[num]++];
+	init_ctrl_target(t, ui[0]->elems[i], kind);
+	t.elem = i;
+      }
+    // map[num] now points to the end of each range, shift them back
+    for (int num = n; num > 0; num--)
+      map[num] = map[num-1];
+    map[0] = pos;
+    return map[n];
+  }
+#endif
+
   ~VSTPlugin()
   {
     const int n = dsp[0]->getNumInputs();
     const int m = dsp[0]->getNumOutputs();
+#if NTHREADS > 1
+    // Stop the worker threads before we destroy the dsps.
+    if (pool) delete pool;
+#endif
+    if (vbuf) {
+      for (int l = 0; l < ndsps; l++) {
+	for (int i = 0; i < m; i++)
+	  free_buffer(vbuf[l][i]);
+	free(vbuf[l]);
+      }
+      free(vbuf);
+    }
+    free(rvoices);
     for (int i = 0; i < ndsps; i++) {
-      delete dsp[i];
+      dsp[i]->~mydsp();
       delete ui[i];
     }
+    free_arena(arena, arena_size);
+    free(vpos);
+    free(vstart);
+    free(iptr);
+    free(optr);
+    free(chunk_inputs);
+    free(chunk_outputs);
+    delete inbox;
+#if FAUST_SAMPLE_ACCURATE
+    free(events);
+#endif
     free(ctrls);
     free(inctrls);
     free(outctrls);
-    free(ports);
+    delete[] ports;
     free(portvals);
+    delete[] dirty;
+    free(inmask);
+    free(changed);
     free(units);
+    free(dispvals);
+    free(outinfo);
+    free(outzones);
+    free(outvals);
+#if FAUST_PROFILE
+    delete[] prof;
+    free(profctrls);
+#endif
+#if FAUST_XRUN
+    delete[] xrun_log;
+#endif
+#if FAUST_MIDICC
+    free(ctrltargets);
+    free(nrpnmap);
+#endif
+#if FAUST_SMOOTH_BLOCK > 0
+    free(smoothidx);
+    free(smoothctrls);
+    free(smooth);
+    free(nmoving);
+#endif
     for (int ch = 0; ch < 16; ch++)
       free(midivals[ch]);
     if (inbuf) {
@@ -922,9 +2680,18 @@ struct VSTPlugin {
     free(ui);
     if (vd) {
       free(vd->note_info);
+      free(vd->zones);
       free(vd->lastgate);
+#if VOICE_SILENCE_HOLD > 0
+      free(vd->silent);
+      free(vd->dormant);
+#endif
       delete vd;
     }
+    log_report(pluginName());
+#if FAUST_LOG
+    log_release();
+#endif
   }
 
   // Voice allocation.
@@ -932,23 +2699,21 @@ struct VSTPlugin {
 #if DEBUG_VOICE_ALLOC
   void print_voices(const char *msg)
   {
-    fprintf(stderr, "%s: notes =", msg);
+    logmsg("%s: notes =", msg);
     for (uint8_t ch = 0; ch < 16; ch++)
       for (int note = 0; note < 128; note++)
 	if (vd->notes[ch][note] >= 0)
-	  fprintf(stderr, " [%d] %d(#%d)", ch, note, vd->notes[ch][note]);
-    fprintf(stderr, "\nqueued (%d):", vd->queued.size());
+	  logmsg(" [%d] %d(#%d)", ch, note, vd->notes[ch][note]);
+    logmsg("\nqueued (%d):", vd->queued.size());
     for (int i = 0; i < nvoices; i++)
-      if (vd->queued.find(i) != vd->queued.end()) fprintf(stderr, " #%d", i);
-    fprintf(stderr, "\nused (%d):", vd->n_used);
-    for (boost::circular_buffer<int>::iterator it = vd->used_voices.begin();
-	 it != vd->used_voices.end(); it++)
-      fprintf(stderr, " #%d->%d", *it, vd->note_info[*it].note);
-    fprintf(stderr, "\nfree (%d):", vd->n_free);
-    for (boost::circular_buffer<int>::iterator it = vd->free_voices.begin();
-	 it != vd->free_voices.end(); it++)
-      fprintf(stderr, " #%d", *it);
-    fprintf(stderr, "\n");
+      if (vd->queued.contains(i)) logmsg(" #%d", i);
+    logmsg("\nused (%d):", vd->n_used);
+    for (int i = vd->used_voices.head; i >= 0; i = vd->next[i])
+      logmsg(" #%d->%d", i, vd->note_info[i].note);
+    logmsg("\nfree (%d):", vd->n_free);
+    for (int i = vd->free_voices.head; i >= 0; i = vd->next[i])
+      logmsg(" #%d", i);
+    logmsg("\n");
   }
 #endif
 
@@ -960,25 +2725,20 @@ struct VSTPlugin {
       voice_off(i);
       voice_on(i, note, vel, ch);
       // move this voice to the end of the used list
-      for (boost::circular_buffer<int>::iterator it =
-	     vd->used_voices.begin();
-	   it != vd->used_voices.end(); it++) {
-	if (*it == i) {
-	  vd->used_voices.erase(it);
-	  vd->used_voices.push_back(i);
-	  break;
-	}
-      }
+      vd->erase(vd->used_voices, i);
+      vd->push_back(vd->used_voices, i);
+      vd->chan_erase(ch, i);
+      vd->chan_push_back(ch, i);
 #if DEBUG_VOICE_ALLOC
       print_voices("retrigger");
 #endif
       return i;
     } else if (vd->n_free > 0) {
       // take voice from free list
-      int i = vd->free_voices.front();
-      vd->free_voices.pop_front();
+      int i = vd->pop_front(vd->free_voices);
       vd->n_free--;
-      vd->used_voices.push_back(i);
+      vd->push_back(vd->used_voices, i);
+      vd->chan_push_back(ch, i);
       vd->note_info[i].ch = ch;
       vd->note_info[i].note = note;
       vd->n_used++;
@@ -999,8 +2759,10 @@ struct VSTPlugin {
       voice_off(i);
       vd->notes[oldch][oldnote] = -1;
       vd->queued.erase(i);
-      vd->used_voices.pop_front();
-      vd->used_voices.push_back(i);
+      vd->pop_front(vd->used_voices);
+      vd->push_back(vd->used_voices, i);
+      vd->chan_erase(oldch, i);
+      vd->chan_push_back(ch, i);
       vd->note_info[i].ch = ch;
       vd->note_info[i].note = note;
       voice_on(i, note, vel, ch);
@@ -1016,30 +2778,33 @@ struct VSTPlugin {
   {
     int i = vd->notes[ch][note];
     if (i >= 0) {
+      sync_voice(i);
       if (vd->lastgate[i] == 0.0f && gate >= 0) {
-	// zero-length note, queued for later
-	vd->queued.insert(i);
-	vd->notes[ch][note] = -1;
+	if (rendering && cur_frame < cur_blocksz) {
+	  // zero-length note during sample-accurate processing, let the synth
+	  // see the gate for one sample before we turn it off
+	  int frame = cur_frame++;
+	  sync_voice(i);
+	  cur_frame = frame;
+	} else {
+	  // zero-length note, queued for later
+	  vd->queued.insert(i);
+	  vd->notes[ch][note] = -1;
 #if DEBUG_VOICE_ALLOC
-	print_voices("dealloc (queued)");
+	  print_voices("dealloc (queued)");
 #endif
-	return i;
+	  return i;
+	}
       }
       assert(vd->n_free < nvoices);
-      vd->free_voices.push_back(i);
+      // move this voice from the used to the free list
+      vd->erase(vd->used_voices, i);
+      vd->chan_erase(ch, i);
+      vd->n_used--;
+      vd->push_back(vd->free_voices, i);
       vd->n_free++;
       voice_off(i);
       vd->notes[ch][note] = -1;
-      // erase this voice from the used list
-      for (boost::circular_buffer<int>::iterator it =
-	     vd->used_voices.begin();
-	   it != vd->used_voices.end(); it++) {
-	if (*it == i) {
-	  vd->used_voices.erase(it);
-	  vd->n_used--;
-	  break;
-	}
-      }
 #if DEBUG_VOICE_ALLOC
       print_voices("dealloc");
 #endif
@@ -1051,57 +2816,275 @@ struct VSTPlugin {
 
   float midicps(int8_t note, uint8_t chan)
   {
-    float pitch = note + vd->tune[chan] +
-      vd->tuning[chan][note%12] + vd->bend[chan];
-    return 440.0*pow(2, (pitch-69.0)/12.0);
+    return vd->freqs[chan][note]*vd->bendf[chan];
+  }
+
+  // Recompute the note frequencies of the given channel after tuning
+  // changes.
+  void update_pitch(uint8_t chan)
+  {
+    for (int note = 0; note < 128; note++) {
+      float pitch = note + vd->tune[chan] + vd->tuning[chan][note%12];
+      vd->freqs[chan][note] = 440.0*pow(2, (pitch-69.0)/12.0);
+    }
+  }
+
+  void set_bend(uint8_t chan, float bend)
+  {
+    vd->bend[chan] = bend;
+    vd->bendf[chan] = pow(2, bend/12.0);
   }
 
   void voice_on(int i, int8_t note, int8_t vel, uint8_t ch)
   {
+    sync_voice(i);
     if (vd->lastgate[i] == 1.0f && gate >= 0) {
       // Make sure that the synth sees the 0.0f gate so that the voice is
       // properly retriggered.
-      *ui[i]->elems[gate].zone = 0.0f;
+      *vd->zones[i].gate = 0.0f;
       dsp[i]->compute(1, inbuf, outbuf);
+#if FAUST_XRUN
+      xrun_retrig++;
+#endif
     }
 #if DEBUG_VOICES
-    fprintf(stderr, "voice on: %d %d (%g Hz) %d (%g)\n", i,
-	    note, midicps(note, ch), vel, vel/127.0);
+    logmsg("voice on: %d %d (%g Hz) %d (%g)\n", i,
+	   note, midicps(note, ch), vel, vel/127.0);
+#endif
+#if VOICE_SILENCE_HOLD > 0
+    // wake up the voice if needed
+    vd->silent[i] = -1;
+    vd->dormant[i] = false;
 #endif
+    vd->last = i;
     if (freq >= 0)
-      *ui[i]->elems[freq].zone = midicps(note, ch);
+      jump_zone(i, freq, midicps(note, ch));
     if (gate >= 0)
-      *ui[i]->elems[gate].zone = 1.0f;
+      *vd->zones[i].gate = 1.0f;
     if (gain >= 0)
-      *ui[i]->elems[gain].zone = vel/127.0;
+      *vd->zones[i].gain = vel/127.0;
     // reinitialize the per-channel control data for this voice
     for (int idx = 0; idx < n_in; idx++) {
       int j = inctrls[idx], k = ui[0]->elems[j].port;
-      *ui[i]->elems[j].zone = midivals[ch][k];
+      jump_zone(i, j, midivals[ch][k]);
     }
   }
 
   void voice_off(int i)
   {
 #if DEBUG_VOICES
-    fprintf(stderr, "voice off: %d\n", i);
+    logmsg("voice off: %d\n", i);
+#endif
+    sync_voice(i);
+    if (gate >= 0)
+      *vd->zones[i].gate = 0.0f;
+#if VOICE_SILENCE_HOLD > 0
+    // start watching the voice's output for silence
+    if (vd->silent[i] < 0) vd->silent[i] = 0;
+#endif
+  }
+
+#if VOICE_SILENCE_HOLD > 0
+  void check_silence(int i, int len, float **buf)
+  {
+    // Check whether the output of a released voice stays below the silence
+    // threshold.
+    static const float level = pow(10.0, VOICE_SILENCE/20.0);
+    const int m = dsp[0]->getNumOutputs();
+    for (int k = 0; k < m; k++)
+      if (mixer->peak(buf[k], len) > level) {
+	vd->silent[i] = 0;
+	return;
+      }
+    vd->silent[i] += len;
+  }
+
+  void check_dormant(int i)
+  {
+    // Make a voice dormant if it has been silent for long enough. This is
+    // only done at the end of a block, so that a voice never goes dormant in
+    // the middle of the block.
+    if (vd->silent[i] >= (int)((double)rate*VOICE_SILENCE_HOLD/1000.0)) {
+      vd->dormant[i] = true;
+#if DEBUG_VOICES
+      logmsg("voice dormant: %d\n", i);
+#endif
+    }
+  }
+#endif
+
+  // Render voice l (or the dsp of a simple effect) from frame 'from' up to
+  // frame 'to' of the current block.
+  void render(int l, int from, int to)
+  {
+#if FAUST_SMOOTH_BLOCK > 0
+    // Voices with moving controls are rendered in sub-blocks, advancing the
+    // control ramps before each sub-block.
+    while (nmoving[l] > 0 && from < to) {
+      int len = min(FAUST_SMOOTH_BLOCK, to-from);
+      advance_smooth(l, len);
+      render_block(l, from, from+len);
+      from += len;
+    }
+    if (from < to)
 #endif
+      render_block(l, from, to);
+  }
+
+  void render_block(int l, int from, int to)
+  {
+    const int n = dsp[0]->getNumInputs(), m = dsp[0]->getNumOutputs();
+    const int len = to-from;
+    float **in = iptr+l*n, **out = optr+l*m;
+    for (int i = 0; i < n; i++)
+      in[i] = cur_inputs[i]+from;
+    if (!vd) {
+      // Simple effect: We can write directly to the output buffers.
+      for (int i = 0; i < m; i++)
+	out[i] = cur_outputs[i]+from;
+      dsp[0]->compute(len, in, out);
+      return;
+    }
+    if (vstart[l] < 0) vstart[l] = from;
+    // Render into the voice buffer, the voices are mixed down later.
+    for (int i = 0; i < m; i++)
+      out[i] = vbuf[l][i]+from;
+    dsp[l]->compute(len, in, out);
+    // Keep track of the last gate seen by each voice, so that voices can be
+    // forcibly retriggered if needed.
     if (gate >= 0)
-      *ui[i]->elems[gate].zone = 0.0f;
+      vd->lastgate[l] = *vd->zones[l].gate;
+#if VOICE_SILENCE_HOLD > 0
+    if (vd->silent[l] >= 0) check_silence(l, len, out);
+#endif
+  }
+
+  // Sample-accurate processing: Render dsp i up to the current frame before
+  // its controls get changed by a MIDI event.
+  void sync_voice(int i)
+  {
+    if (!rendering || vpos[i] >= cur_frame) return;
+#if FAUST_PROFILE
+    int phase = prof_switch(PROF_VOICES);
+#endif
+#if VOICE_SILENCE_HOLD > 0
+    if (!vd || !vd->dormant[i])
+#endif
+      render(i, vpos[i], cur_frame);
+    vpos[i] = cur_frame;
+#if FAUST_PROFILE
+    prof_switch(phase);
+#endif
+  }
+
+  // Set control element j of dsp l to the given value. Smoothed controls ramp
+  // to the new value, the ramp is carried out by render() above.
+  void set_zone(int l, int j, float val)
+  {
+#if FAUST_SMOOTH_BLOCK > 0
+    int s = smoothidx[j];
+    if (s >= 0 && !smooth_jump) {
+      const SmoothCtrl &c = smoothctrls[s];
+      SmoothState &st = smooth[l*n_smooth+s];
+      if (st.left == 0) {
+	// start a new ramp at the current value
+	st.cur = *ui[l]->elems[j].zone;
+	if (st.cur == val) return;
+	nmoving[l]++;
+      } else if (st.target == val)
+	return;
+      st.target = val;
+      st.inc = (val-st.cur)/c.len;
+      st.left = c.len;
+      return;
+    }
+#endif
+    *ui[l]->elems[j].zone = val;
+  }
+
+  // Same as above, but always apply the new value immediately, cancelling
+  // any ramp in progress (new notes).
+  void jump_zone(int l, int j, float val)
+  {
+#if FAUST_SMOOTH_BLOCK > 0
+    int s = smoothidx[j];
+    if (s >= 0 && smooth[l*n_smooth+s].left > 0) {
+      smooth[l*n_smooth+s].left = 0;
+      nmoving[l]--;
+    }
+#endif
+    *ui[l]->elems[j].zone = val;
+  }
+
+#if FAUST_SMOOTH_BLOCK > 0
+  // Advance the moving controls of dsp l by len samples. The zones receive
+  // the values at the end of the sub-block.
+  void advance_smooth(int l, int len)
+  {
+    SmoothState *st = smooth+l*n_smooth;
+    for (int s = 0; s < n_smooth; s++) {
+      if (st[s].left == 0) continue;
+      const SmoothCtrl &c = smoothctrls[s];
+      if (st[s].left <= len) {
+	st[s].cur = st[s].target;
+	st[s].left = 0;
+	nmoving[l]--;
+      } else {
+	st[s].left -= len;
+	if (c.exp)
+	  st[s].cur = st[s].target + (st[s].cur-st[s].target)*
+	    (len == FAUST_SMOOTH_BLOCK ? c.dblk : powf(c.d, len));
+	else
+	  st[s].cur += st[s].inc*len;
+      }
+      *ui[l]->elems[c.elem].zone = st[s].cur;
+    }
+  }
+
+  // Compute the ramp parameters for the current sample rate, and stop all
+  // ramps (the dsps have just been reinitialized).
+  void init_smooth()
+  {
+    for (int s = 0; s < n_smooth; s++) {
+      SmoothCtrl &c = smoothctrls[s];
+      c.len = (int)(c.ms*rate/1000.0);
+      if (c.len < 1) c.len = 1;
+      // exponential ramps are within 60 dB of the target after len samples,
+      // at which point we just jump to the target
+      c.d = pow(0.001, 1.0/c.len);
+      c.dblk = pow(c.d, FAUST_SMOOTH_BLOCK);
+    }
+    for (int l = 0; l < ndsps; l++) {
+      for (int s = 0; s < n_smooth; s++)
+	smooth[l*n_smooth+s].left = 0;
+      nmoving[l] = 0;
+    }
+  }
+#endif
+
+  // Render the rest of the block for a single voice. This may be invoked on
+  // the worker threads, so it must not touch any data shared with other
+  // voices.
+  static void render_voice(void *data, int k)
+  {
+    VSTPlugin *p = (VSTPlugin*)data;
+    int l = p->rvoices[k];
+    if (p->vpos[l] < p->cur_blocksz)
+      p->render(l, p->vpos[l], p->cur_blocksz);
+#if VOICE_SILENCE_HOLD > 0
+    p->check_dormant(l);
+#endif
   }
 
   void update_voices(uint8_t chan)
   {
     // update running voices on the given channel after tuning or pitch bend
     // changes
-    for (boost::circular_buffer<int>::iterator it =
-	   vd->used_voices.begin();
-	 it != vd->used_voices.end(); it++) {
-      int i = *it;
-      if (vd->note_info[i].ch == chan && freq >= 0) {
-	int note = vd->note_info[i].note;
-	*ui[i]->elems[freq].zone = midicps(note, chan);
-      }
+    if (freq < 0) return;
+    for (int i = vd->chan_voices[chan].head; i >= 0; i = vd->cnext[i]) {
+      int note = vd->note_info[i].note;
+      sync_voice(i);
+      set_zone(i, freq, midicps(note, chan));
     }
   }
 
@@ -1110,67 +3093,52 @@ struct VSTPlugin {
     for (int i = 0; i < nvoices; i++)
       voice_off(i);
     for (int i = 0; i < 16; i++)
-      vd->bend[i] = 0.0f;
+      set_bend(i, 0.0f);
     memset(vd->notes, 0xff, sizeof(vd->notes));
-    vd->free_voices.clear();
-    vd->n_free = nvoices;
-    for (int i = 0; i < nvoices; i++)
-      vd->free_voices.push_back(i);
+    vd->reset_voices(nvoices);
     vd->queued.clear();
-    vd->used_voices.clear();
-    vd->n_used = 0;
   }
 
   void all_notes_off(uint8_t chan)
   {
-    for (boost::circular_buffer<int>::iterator it =
-	   vd->used_voices.begin();
-	 it != vd->used_voices.end(); ) {
-      int i = *it;
-      if (vd->note_info[i].ch == chan) {
-	assert(vd->n_free < nvoices);
-	vd->free_voices.push_back(i);
-	vd->n_free++;
-	voice_off(i);
-	vd->notes[vd->note_info[i].ch][vd->note_info[i].note] = -1;
-	vd->queued.erase(i);
-	// erase this voice from the used list
-	it = vd->used_voices.erase(it);
-	vd->n_used--;
+    for (int i = vd->chan_voices[chan].head, j; i >= 0; i = j) {
+      j = vd->cnext[i];
+      assert(vd->n_free < nvoices);
+      // move this voice from the used to the free list
+      vd->erase(vd->used_voices, i);
+      vd->chan_erase(chan, i);
+      vd->n_used--;
+      vd->push_back(vd->free_voices, i);
+      vd->n_free++;
+      voice_off(i);
+      vd->notes[chan][vd->note_info[i].note] = -1;
+      vd->queued.erase(i);
 #if DEBUG_VOICE_ALLOC
-	print_voices("dealloc (all-notes-off)");
+      print_voices("dealloc (all-notes-off)");
 #endif
-      } else
-	it++;
     }
-    vd->bend[chan] = 0.0f;
+    set_bend(chan, 0.0f);
   }
 
   void queued_notes_off()
   {
     if (vd->queued.empty()) return;
-    for (int i = 0; i < nvoices; i++)
-      if (vd->queued.find(i) != vd->queued.end()) {
-	assert(vd->n_free < nvoices);
-	vd->free_voices.push_back(i);
-	vd->n_free++;
-	voice_off(i);
-	vd->notes[vd->note_info[i].ch][vd->note_info[i].note] = -1;
-	vd->queued.erase(i);
-	// erase this voice from the used list
-	for (boost::circular_buffer<int>::iterator it =
-	       vd->used_voices.begin();
-	     it != vd->used_voices.end(); it++) {
-	  if (*it == i) {
-	    vd->used_voices.erase(it);
-	    vd->n_used--;
-	    break;
-	  }
-	}
+    for (int i = vd->queued.next(0); i >= 0 && i < nvoices;
+	 i = vd->queued.next(i+1)) {
+      assert(vd->n_free < nvoices);
+      // move this voice from the used to the free list
+      vd->erase(vd->used_voices, i);
+      vd->chan_erase(vd->note_info[i].ch, i);
+      vd->n_used--;
+      vd->push_back(vd->free_voices, i);
+      vd->n_free++;
+      voice_off(i);
+      vd->notes[vd->note_info[i].ch][vd->note_info[i].note] = -1;
+      vd->queued.erase(i);
 #if DEBUG_VOICE_ALLOC
-	print_voices("dealloc (unqueued)");
+      print_voices("dealloc (unqueued)");
 #endif
-      }
+    }
   }
 
   // Plugin activation status. suspend() deactivates a plugin (disables audio
@@ -1185,12 +3153,23 @@ struct VSTPlugin {
   {
     active = false;
     if (maxvoices > 0) all_notes_off();
+    log_report(pluginName());
   }
 
   void resume()
   {
+    lock_arena(arena, arena_size);
     for (int i = 0; i < ndsps; i++)
       dsp[i]->init(rate);
+#if VOICE_SILENCE_HOLD > 0
+    if (vd) {
+      // Reinitialized voices need to be checked for silence again.
+      for (int i = 0; i < ndsps; i++) {
+	vd->silent[i] = 0;
+	vd->dormant[i] = false;
+      }
+    }
+#endif
     for (int i = 0, j = 0; i < ui[0]->nelems; i++) {
       int p = ui[0]->elems[i].port;
       if (p >= 0) {
@@ -1198,26 +3177,143 @@ struct VSTPlugin {
 	portvals[p] = val;
       }
     }
+#if FAUST_SMOOTH_BLOCK > 0
+    init_smooth();
+    smooth_jump = true;
+#endif
+    // Make sure that the current port values get propagated to the
+    // reinitialized dsps.
+    mark_dirty();
     active = true;
   }
 
+  // Flag control port k as modified, so that its value gets propagated to the
+  // dsps in the next cycle of process_audio(). This can be invoked from any
+  // thread. If k is negative, all ports are flagged.
+  void mark_dirty(int k = -1)
+  {
+    if (k >= 0)
+      dirty[k>>6].fetch_or((uint64_t)1 << (k&63), std::memory_order_release);
+    else
+      for (int w = 0; w < n_dirty; w++)
+	dirty[w].store(~(uint64_t)0, std::memory_order_release);
+  }
+
   void set_rate(int sr)
   {
     rate = sr;
     for (int i = 0; i < ndsps; i++)
       dsp[i]->init(rate);
+#if FAUST_SMOOTH_BLOCK > 0
+    init_smooth();
+#endif
+  }
+
+  // Set the maximum block size. This resizes the mixdown buffers, so it must
+  // not be called while the plugin is processing audio. Larger blocks will
+  // still be processed, but they're split into chunks of this size.
+  void set_blocksize(int blocksz)
+  {
+    int m = dsp[0]->getNumOutputs();
+    if (!vbuf || blocksz <= 0 || blocksz == n_samples) return;
+    for (int l = 0; l < ndsps; l++)
+      for (int i = 0; i < m; i++) {
+	free_buffer(vbuf[l][i]);
+	vbuf[l][i] = alloc_buffer(blocksz);
+	assert(vbuf[l][i]);
+      }
+    n_samples = blocksz;
+#if FAUST_XRUN
+    xrun_flags |= XRUN_RESIZED;
+#endif
   }
 
   // Audio and MIDI process functions. The plugin should run these in the
   // appropriate real-time callbacks.
 
   void process_audio(int blocksz, float **inputs, float **outputs)
+  {
+#if FAUST_PROFILE
+    prof_begin();
+#endif
+    fetch_midi();
+#if FAUST_SAMPLE_ACCURATE
+    // Events past the end of the block (if any) are processed at its end.
+    for (int ev = n_events-1; ev >= 0 && events[ev].frame >= blocksz; ev--)
+      events[ev].frame = blocksz-1;
+#if MIDI_COALESCE
+    coalesce_midi();
+#endif
+#endif
+#if FAUST_XRUN
+#if FAUST_SAMPLE_ACCURATE
+    xrun_events = n_events;
+#endif
+    xrun_voices = active_voices();
+#endif
+    if (!vbuf || blocksz <= n_samples) {
+      process_block(blocksz, inputs, outputs, 0);
+    } else {
+      // The host exceeded the maximum block size, so we have to split the
+      // block into chunks which fit into our buffers.
+      int n = dsp[0]->getNumInputs(), m = dsp[0]->getNumOutputs();
+#if FAUST_XRUN
+      xrun_flags |= XRUN_SPLIT;
+#endif
+      for (int offs = 0; offs < blocksz; offs += n_samples) {
+	int len = min(n_samples, blocksz-offs);
+	for (int i = 0; i < n; i++)
+	  chunk_inputs[i] = inputs[i]+offs;
+	for (int i = 0; i < m; i++)
+	  chunk_outputs[i] = outputs[i]+offs;
+	process_block(len, chunk_inputs, chunk_outputs, offs);
+      }
+    }
+#if FAUST_SAMPLE_ACCURATE
+    n_events = ev_pos = 0;
+#endif
+#if FAUST_PROFILE
+    prof_switch(PROF_OUTPUT);
+#endif
+    // Ask the host to update its display if needed, observing the rate limit.
+    modified = false;
+    disp_wait = disp_wait > blocksz ? disp_wait-blocksz : 0;
+    if (disp_pending && disp_wait == 0) {
+      modified = true;
+      disp_pending = false;
+      if (DISPLAY_RATE > 0)
+	disp_wait = rate/DISPLAY_RATE;
+      for (int i = 0; i < n_out; i++) {
+	int k = ui[0]->elems[outctrls[i]].port;
+	dispvals[k] = ports[k].load(std::memory_order_relaxed);
+      }
+    }
+#if FAUST_PROFILE
+    prof_end(blocksz);
+#endif
+  }
+
+  // Process a single block (or chunk of a block) of audio, starting at the
+  // given frame offset relative to the MIDI events in the queue.
+  void process_block(int blocksz, float **inputs, float **outputs, int offs)
   {
     int n = dsp[0]->getNumInputs(), m = dsp[0]->getNumOutputs();
     AVOIDDENORMALS;
-    modified = false;
+#if FAUST_PROFILE
+    prof_switch(PROF_MIDI);
+#endif
     if (maxvoices > 0) queued_notes_off();
+#if FAUST_MTS
+    // Carry out pending tuning changes.
+    if (tuning_req.load(std::memory_order_relaxed) >= 0)
+      change_tuning(tuning_req.exchange(-1, std::memory_order_acquire));
+#endif
     if (!active) {
+#if FAUST_SAMPLE_ACCURATE
+      // Process pending MIDI events right away.
+      for (; ev_pos < n_events; ev_pos++)
+	process_event(events[ev_pos]);
+#endif
       // Depending on the plugin architecture, this code might never be
       // invoked, since the plugin is deactivitated at this point. But let's
       // do something reasonable here anyway.
@@ -1235,120 +3331,638 @@ struct VSTPlugin {
       return;
     }
     // Handle changes in the polyphony control.
-    if (nvoices != poly && poly > 0 && poly <= maxvoices) {
-      modified = true;
+    int req = poly.load(std::memory_order_relaxed);
+    if (nvoices != req && req > 0 && req <= maxvoices) {
+      disp_pending = true;
       for (int i = 0; i < nvoices; i++)
 	voice_off(i);
-      nvoices = poly;
+      nvoices = req;
       // Reset the voice allocation.
       memset(vd->notes, 0xff, sizeof(vd->notes));
-      vd->free_voices.clear();
-      vd->n_free = nvoices;
-      for (int i = 0; i < nvoices; i++)
-	vd->free_voices.push_back(i);
-      vd->used_voices.clear();
-      vd->n_used = 0;
-    } else
-      poly = nvoices;
+      vd->reset_voices(nvoices);
+    } else if (nvoices != req)
+      poly.compare_exchange_strong(req, nvoices);
+    // Start rendering the block. From here on, the voices are rendered
+    // incrementally as MIDI events change their controls.
+    rendering = true;
+    cur_frame = 0;
+    cur_blocksz = blocksz;
+    cur_inputs = inputs;
+    cur_outputs = outputs;
+    for (int l = 0; l < ndsps; l++) {
+      vpos[l] = 0;
+      vstart[l] = -1;
+    }
+#if FAUST_SAMPLE_ACCURATE
+    // MIDI events at the very beginning of the block are processed right
+    // away (see below).
+    int ev = ev_pos;
+    while (ev < n_events && events[ev].frame <= offs)
+      process_event(events[ev++]);
+#endif
     // Only update the controls (of all voices simultaneously) if a port value
     // actually changed. This is necessary to allow MIDI controllers to modify
     // the values for individual MIDI channels (see processEvents below). Also
     // note that this will be done *after* processing the MIDI controller data
-    // for the current audio block, so manual inputs can still override these.
+    // at the beginning of the current audio block, so manual inputs can still
+    // override these.
+    // To these ends, we only look at the ports flagged in the dirty mask.
+#if FAUST_PROFILE
+    prof_switch(PROF_CTRL);
+#endif
     bool is_instr = maxvoices > 0;
-    for (int i = 0; i < n_in; i++) {
-      int j = inctrls[i], k = ui[0]->elems[j].port;
-      float &oldval = portvals[k], newval = ports[k];
-      if (newval != oldval) {
-	modified = true;
-	if (is_instr) {
-	  // instrument: update running voices
-	  for (boost::circular_buffer<int>::iterator it =
-		 vd->used_voices.begin();
-	       it != vd->used_voices.end(); it++) {
-	    int i = *it;
-	    *ui[i]->elems[j].zone = newval;
-	  }
-	} else {
-	  // simple effect: here we only have a single dsp instance
-	  *ui[0]->elems[j].zone = newval;
+    int n_changed = 0;
+    for (int w = 0; w < n_dirty; w++) {
+      uint64_t bits = dirty[w].exchange(0, std::memory_order_acquire) &
+	inmask[w];
+      while (bits) {
+	int k = (w<<6) + __builtin_ctzll(bits);
+	bits &= bits-1;
+	float &oldval = portvals[k];
+	float newval = ports[k].load(std::memory_order_relaxed);
+	if (newval != oldval) {
+	  changed[n_changed++] = k;
+	  // also update the MIDI controller data for all channels (manual
+	  // control input is always omni)
+	  for (int ch = 0; ch < 16; ch++)
+	    midivals[ch][k] = newval;
+	  // record the new value
+	  oldval = newval;
 	}
-	// also update the MIDI controller data for all channels (manual
-	// control input is always omni)
-	for (int ch = 0; ch < 16; ch++)
-	  midivals[ch][k] = newval;
-	// record the new value
-	oldval = newval;
       }
     }
-    // Initialize the output buffers.
-    if (n_samples < blocksz) {
-      // We need to enlarge the buffers. We're not officially allowed to do
-      // this here (presumably in the realtime thread), but since we usually
-      // don't know the hosts's block size beforehand, there's really nothing
-      // else that we can do. Let's just hope that doing this once suffices,
-      // then hopefully noone will notice.
-      if (outbuf) {
-	for (int i = 0; i < m; i++) {
-	  outbuf[i] = (float*)realloc(outbuf[i],
-				      blocksz*sizeof(float));
-	  assert(outbuf[i]);
+    if (n_changed > 0) {
+      disp_pending = true;
+      if (is_instr) {
+	// instrument: update running voices, one voice at a time
+	for (int i = vd->used_voices.head; i >= 0; i = vd->next[i])
+	  for (int c = 0; c < n_changed; c++) {
+	    int k = changed[c];
+	    set_zone(i, ctrls[k], portvals[k]);
+	  }
+      } else {
+	// simple effect: here we only have a single dsp instance
+	for (int c = 0; c < n_changed; c++) {
+	  int k = changed[c];
+	  set_zone(0, ctrls[k], portvals[k]);
 	}
       }
-      n_samples = blocksz;
     }
-    if (outbuf) {
-      // Polyphonic instrument: Mix the voices down to one signal.
-      for (int i = 0; i < m; i++)
-	for (unsigned j = 0; j < blocksz; j++)
-	  outputs[i][j] = 0.0f;
+#if FAUST_SMOOTH_BLOCK > 0
+    smooth_jump = false;
+#endif
+#if FAUST_SAMPLE_ACCURATE
+#if FAUST_PROFILE
+    prof_switch(PROF_MIDI);
+#endif
+    // Process the remaining MIDI events at their exact frame offsets. The
+    // voices affected by each event are rendered up to that point first (see
+    // sync_voice above), all other voices are left alone.
+    for (; ev < n_events && events[ev].frame < offs+blocksz; ev++) {
+      cur_frame = events[ev].frame-offs;
+      process_event(events[ev]);
+    }
+    ev_pos = ev;
+#endif
+    // Render the rest of the block.
+#if FAUST_PROFILE
+    prof_switch(PROF_VOICES);
+#endif
+    cur_frame = blocksz;
+    if (is_instr) {
+      // Polyphonic instrument: Render the voices, each into its own buffer
+      // (in parallel if we have worker threads).
+      int nactive = 0;
       for (int l = 0; l < nvoices; l++) {
-	// Let Faust do all the hard work.
-	dsp[l]->compute(blocksz, inputs, outbuf);
-	for (int i = 0; i < m; i++)
-	  for (unsigned j = 0; j < blocksz; j++)
-	    outputs[i][j] += outbuf[i][j];
+#if VOICE_SILENCE_HOLD > 0
+	// Dormant voices only produce silence, skip them.
+	if (vd->dormant[l]) continue;
+#endif
+	rvoices[nactive++] = l;
       }
-    } else {
-      // Simple effect: We can write directly to the output buffer.
-      dsp[0]->compute(blocksz, inputs, outputs);
+#if NTHREADS > 1
+      if (pool && nactive > 1)
+	pool->run(render_voice, this, nactive);
+      else
+#endif
+	for (int k = 0; k < nactive; k++)
+	  render_voice(this, k);
+#if FAUST_PROFILE
+      prof_switch(PROF_MIX);
+#endif
+      // Mix the voices down in voice order, so that the result doesn't
+      // depend on the order in which the voices were rendered. Voices which
+      // only started playing in the middle of the block get their buffers
+      // zero-filled up to that point. We sum up to four voices in each pass
+      // over the output buffers here.
+      for (int k = 0; k < nactive; k++) {
+	int l = rvoices[k], from = vstart[l];
+	if (from < 0 || from > blocksz) from = blocksz;
+	if (from > 0)
+	  for (int i = 0; i < m; i++)
+	    memset(vbuf[l][i], 0, from*sizeof(float));
+      }
+      for (int i = 0; i < m; i++) {
+	float *src[4];
+	int nsrc = 0;
+	bool add = false;
+	for (int k = 0; k < nactive; k++) {
+	  src[nsrc++] = vbuf[rvoices[k]][i];
+	  if (nsrc == 4) {
+	    mixer->mix(outputs[i], src, nsrc, blocksz, add);
+	    add = true;
+	    nsrc = 0;
+	  }
+	}
+	if (nsrc > 0) {
+	  mixer->mix(outputs[i], src, nsrc, blocksz, add);
+	  add = true;
+	}
+	if (!add)
+	  memset(outputs[i], 0, blocksz*sizeof(float));
+      }
+    } else if (vpos[0] < blocksz) {
+      // Simple effect: Render the single dsp instance.
+      render(0, vpos[0], blocksz);
     }
+    rendering = false;
+#if FAUST_PROFILE
+    prof_switch(PROF_OUTPUT);
+#endif
     // Finally grab the passive controls and write them back to the
     // corresponding control ports. NOTE: Depending on the plugin
     // architecture, this might require a host call to get the control GUI
     // updated in real-time (if the host supports this at all).
-    // FIXME: It's not clear how to aggregate the data of the different
-    // voices. We compute the maximum of each control for now.
-    if (n_out > 0) modified = true;
-    for (int i = 0; i < n_out; i++) {
-      int j = outctrls[i], k = ui[0]->elems[j].port;
-      float *z = ui[0]->elems[j].zone;
-      ports[k] = *z;
-      for (int l = 1; l < nvoices; l++) {
-	float *z = ui[l]->elems[j].zone;
-	if (ports[k] < *z)
-	  ports[k] = *z;
+    if (n_out > 0) update_outputs();
+  }
+
+  // Aggregate the passive controls of the active voices according to their
+  // poly attributes (the maximum by default). Voices which are dormant don't
+  // count; if no voice is active, the controls are reset to their minimum
+  // (max, last, newest) or zero (sum, rms).
+  void update_outputs()
+  {
+    const int *st = outstart;
+    float *vals = outvals;
+    if (!vd) {
+      // simple effect: there's only a single dsp instance
+      for (int r = 0; r < n_out; r++)
+	vals[r] = *outzones[r];
+    } else {
+      int nact = 0;
+      for (int r = st[POLY_SUM]; r < st[POLY_LAST]; r++)
+	vals[r] = 0.0f;
+      for (int l = 0; l < nvoices; l++) {
+#if VOICE_SILENCE_HOLD > 0
+	if (vd->dormant[l]) continue;
+#endif
+	float **z = outzones+l*n_out;
+	if (nact++ == 0)
+	  for (int r = st[POLY_MAX]; r < st[POLY_SUM]; r++)
+	    vals[r] = *z[r];
+	else
+	  for (int r = st[POLY_MAX]; r < st[POLY_SUM]; r++)
+	    vals[r] = max(vals[r], *z[r]);
+	for (int r = st[POLY_SUM]; r < st[POLY_RMS]; r++)
+	  vals[r] += *z[r];
+	for (int r = st[POLY_RMS]; r < st[POLY_LAST]; r++)
+	  vals[r] += *z[r] * *z[r];
       }
+      if (nact == 0)
+	for (int r = st[POLY_MAX]; r < st[POLY_SUM]; r++)
+	  vals[r] = outinfo[r].min;
+      // root of the sum of squares (the total level of the voices, assuming
+      // that they're uncorrelated)
+      for (int r = st[POLY_RMS]; r < st[POLY_LAST]; r++)
+	vals[r] = sqrtf(vals[r]);
+      // last: the most recently triggered voice, newest: the most recently
+      // triggered voice which is still being held
+      int last = vd->last, newest = vd->used_voices.tail;
+#if VOICE_SILENCE_HOLD > 0
+      if (last >= 0 && vd->dormant[last]) last = -1;
+#endif
+      if (last >= nvoices) last = -1;
+      for (int r = st[POLY_LAST]; r < st[POLY_NEWEST]; r++)
+	vals[r] = last >= 0 ? *outzones[last*n_out+r] : outinfo[r].min;
+      for (int r = st[POLY_NEWEST]; r < n_out; r++)
+	vals[r] = newest >= 0 ? *outzones[newest*n_out+r] : outinfo[r].min;
     }
-    // Keep track of the last gates set for each voice, so that voices can be
-    // forcibly retriggered if needed.
-    if (gate >= 0)
-      for (int i = 0; i < nvoices; i++)
-	vd->lastgate[i] =
-	  *ui[i]->elems[gate].zone;
+#if FAUST_PROFILE
+    for (int i = 0; i < n_prof; i++)
+      vals[profctrls[2*i]] = profile_stat(profctrls[2*i+1]);
+#endif
+    for (int r = 0; r < n_out; r++) {
+      int k = outinfo[r].port;
+      ports[k].store(vals[r], std::memory_order_relaxed);
+      // Only bother the host if the value changed noticeably.
+      if (fabs(vals[r]-dispvals[k]) > outinfo[r].eps)
+	disp_pending = true;
+    }
+  }
+
+#if FAUST_PROFILE
+  // Profiling (see FAUST_PROFILE). The time since the last phase switch is
+  // charged to the current phase, prof_switch() returns the previous phase.
+  // All these are only invoked on the audio thread, except profile_load(),
+  // profile_stat() and profile_dump().
+
+  int prof_switch(int phase)
+  {
+    uint64_t t = clock_ns();
+    int old = prof_phase;
+    prof_acc[old] += t-prof_mark;
+    prof_mark = t;
+    prof_phase = phase;
+    return old;
+  }
+
+  void prof_begin()
+  {
+    if (prof_reset.exchange(false, std::memory_order_acquire)) {
+      for (int i = 0; i < PROF_PHASES; i++)
+	prof[i].clear();
+      prof_load.store(0.0f, std::memory_order_relaxed);
+    }
+    memset(prof_acc, 0, sizeof(prof_acc));
+    prof_phase = PROF_MIDI;
+    prof_start = prof_mark = clock_ns();
+  }
+
+  void prof_end(int blocksz)
+  {
+    prof_switch(PROF_MIDI);
+    uint64_t total = prof_mark-prof_start;
+    for (int i = 0; i < PROF_HOST; i++)
+      prof[i].add(prof_acc[i]);
+    prof[PROF_BLOCK].add(total);
+    if (blocksz <= 0) return;
+    // Average the load over PROFILE_TIME seconds.
+    float load = 100.0f*total*1e-9f*rate/blocksz;
+    float a = std::min(1.0f, (float)(blocksz/(PROFILE_TIME*rate)));
+    float avg = prof_load.load(std::memory_order_relaxed);
+    prof_load.store(avg+a*(load-avg), std::memory_order_relaxed);
+  }
+
+  // Record the time (in nsecs) the host took to update its display.
+  void profile_host(uint64_t t)
+  {
+    prof[PROF_HOST].add(t);
+  }
+
+  // Average cpu load (percent).
+  float profile_load()
+  {
+    return prof_load.load(std::memory_order_relaxed);
+  }
+
+  // Value of a profile bargraph.
+  float profile_stat(int stat)
+  {
+    switch (stat) {
+    case PROF_LOAD:
+      return profile_load();
+    case PROF_P50:
+      return prof[PROF_BLOCK].percentile(0.5)*1e-3;
+    case PROF_P99:
+      return prof[PROF_BLOCK].percentile(0.99)*1e-3;
+    case PROF_MAX:
+      return prof[PROF_BLOCK].max.load(std::memory_order_relaxed)*1e-3;
+    default:
+      return 0.0f;
+    }
+  }
+
+  // Print the profiling data on the given stream. This can be invoked from
+  // any thread, while the plugin is running. If reset is true, the data is
+  // cleared afterwards (in the next cycle of process_audio()).
+  void profile_dump(FILE *fp, bool reset = false)
+  {
+    static const char *names[PROF_PHASES] =
+      { "midi", "controls", "voices", "mixdown", "outputs", "host", "block" };
+    uint64_t nblocks = prof[PROF_BLOCK].count.load(std::memory_order_relaxed);
+    fprintf(fp, "%s: %llu blocks, cpu load %.1f%%\n", pluginName(),
+	    (unsigned long long)nblocks, profile_load());
+    fprintf(fp, "%-10s %10s %10s %10s %10s %10s\n", "phase",
+	    "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+    for (int i = 0; i < PROF_PHASES; i++) {
+      const ProfHist &h = prof[i];
+      uint64_t n = h.count.load(std::memory_order_relaxed);
+      if (n == 0) continue;
+      fprintf(fp, "%-10s %10.2f %10.2f %10.2f %10.2f %10.2f\n", names[i],
+	      h.sum.load(std::memory_order_relaxed)*1e-3/n,
+	      h.percentile(0.5)*1e-3, h.percentile(0.9)*1e-3,
+	      h.percentile(0.99)*1e-3,
+	      h.max.load(std::memory_order_relaxed)*1e-3);
+    }
+    if (reset) prof_reset.store(true, std::memory_order_release);
+  }
+#endif
+
+  // Number of voices which are currently computed (1 for an effect).
+  int active_voices()
+  {
+    if (!vd) return 1;
+#if VOICE_SILENCE_HOLD > 0
+    int n = 0;
+    for (int l = 0; l < nvoices; l++)
+      if (!vd->dormant[l]) n++;
+    return n;
+#else
+    return nvoices;
+#endif
+  }
+
+#if FAUST_XRUN
+  // Deadline monitoring (see FAUST_XRUN). The host wrapper invokes
+  // xrun_check() with the time (in nsecs) it took to process a block of the
+  // given size. This must be called on the audio thread, after
+  // process_audio(), the other functions can be invoked from any thread.
+
+  void xrun_check(int blocksz, uint64_t t)
+  {
+    if (xrun_reset.exchange(false, std::memory_order_acquire)) {
+      xrun_blocks.store(0, std::memory_order_relaxed);
+      for (int i = 0; i < XRUN_LEVELS; i++)
+	xrun_counts[i].store(0, std::memory_order_relaxed);
+      xrun_first.store(xrun_seq.load(std::memory_order_relaxed)/2,
+		       std::memory_order_relaxed);
+    }
+    uint64_t block = xrun_blocks.load(std::memory_order_relaxed);
+    xrun_blocks.store(block+1, std::memory_order_relaxed);
+    if (blocksz > 0) {
+      float load = 100.0f*t*1e-9f*rate/blocksz;
+      int level = 0;
+      for (; level < XRUN_LEVELS && load > xrun_pct[level]; level++)
+	xrun_counts[level].store
+	  (xrun_counts[level].load(std::memory_order_relaxed)+1,
+	   std::memory_order_relaxed);
+      if (level > 0) {
+	// Voices may have been started during the block, report the larger
+	// of the counts at the beginning and the end of the block.
+	int voices = std::max(xrun_voices, active_voices());
+	uint64_t seq = xrun_seq.load(std::memory_order_relaxed);
+	XrunRecord &r = xrun_log[seq/2%XRUN_HISTORY];
+	xrun_seq.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	r.block.store(block, std::memory_order_relaxed);
+	r.load.store(load, std::memory_order_relaxed);
+	r.blocksz.store(blocksz, std::memory_order_relaxed);
+	r.voices.store(voices, std::memory_order_relaxed);
+	r.events.store(xrun_events, std::memory_order_relaxed);
+	r.retrig.store(xrun_retrig, std::memory_order_relaxed);
+	r.flags.store(xrun_flags, std::memory_order_relaxed);
+	xrun_seq.store(seq+2, std::memory_order_release);
+	if (XRUN_LOG > 0 && load > XRUN_LOG)
+	  logmsg_rt("%s: deadline miss: %.1f%% (%d voices, %d events, "
+		 "%d retriggers%s)\n", pluginName(), load, voices,
+		 xrun_events, xrun_retrig, xrun_flag_names[xrun_flags&3]);
+      }
+    }
+    xrun_retrig = xrun_flags = 0;
+  }
+
+  // Number of blocks exceeding the i-th threshold (i = -1 gives the total
+  // number of blocks).
+  uint64_t xrun_count(int i)
+  {
+    if (i < 0) return xrun_blocks.load(std::memory_order_relaxed);
+    if (i >= XRUN_LEVELS) return 0;
+    return xrun_counts[i].load(std::memory_order_relaxed);
+  }
+
+  // Print the counters and the most recent records on the given stream. If
+  // reset is true, the counters and records are cleared afterwards (in the
+  // next call of xrun_check()).
+  void xrun_dump(FILE *fp, bool reset = false)
+  {
+    fprintf(fp, "%s: %llu blocks", pluginName(),
+	    (unsigned long long)xrun_count(-1));
+    for (int i = 0; i < XRUN_LEVELS; i++)
+      fprintf(fp, ", %llu > %g%%", (unsigned long long)xrun_count(i),
+	      xrun_pct[i]);
+    fprintf(fp, "\n");
+    uint64_t n = xrun_seq.load(std::memory_order_acquire)/2;
+    uint64_t first = n > XRUN_HISTORY ? n-XRUN_HISTORY : 0;
+    first = std::max(first, xrun_first.load(std::memory_order_relaxed));
+    for (uint64_t k = first; k < n; k++) {
+      XrunRecord &r = xrun_log[k%XRUN_HISTORY];
+      unsigned long long block = r.block.load(std::memory_order_relaxed);
+      float load = r.load.load(std::memory_order_relaxed);
+      int blocksz = r.blocksz.load(std::memory_order_relaxed);
+      int voices = r.voices.load(std::memory_order_relaxed);
+      int events = r.events.load(std::memory_order_relaxed);
+      int retrig = r.retrig.load(std::memory_order_relaxed);
+      int flags = r.flags.load(std::memory_order_relaxed);
+      // Skip the record if the audio thread started overwriting it.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((xrun_seq.load(std::memory_order_relaxed)+1)/2 > k+XRUN_HISTORY)
+	continue;
+      fprintf(fp, "block #%llu: %.1f%% of %d samples, %d voices, "
+	      "%d events, %d retriggers%s\n", block, load, blocksz,
+	      voices, events, retrig, xrun_flag_names[flags&3]);
+    }
+    if (reset) xrun_reset.store(true, std::memory_order_release);
+  }
+#endif
+
+  // Post a MIDI message (up to 4 bytes) or sysex message to the inbox. This
+  // can be invoked from any thread. The message will take effect at the given
+  // frame offset in the next cycle of process_audio() (at the beginning of
+  // the block, if sample-accurate processing is disabled). Returns false if
+  // the message had to be dropped.
+
+  bool push_midi(int frame, const uint8_t *data, int sz)
+  {
+    MidiEvent ev;
+    ev.frame = frame<0?0:frame;
+    ev.sysex = -1;
+    memset(ev.data, 0, 4);
+    memcpy(ev.data, data, sz<4?sz:4);
+    return inbox->push(ev);
+  }
+
+  bool push_sysex(int frame, const uint8_t *data, int sz)
+  {
+    MidiEvent ev;
+    ev.frame = frame<0?0:frame;
+    ev.sysex = inbox->alloc_sysex(data, sz);
+    memset(ev.data, 0, 4);
+    if (ev.sysex < 0) return false;
+    if (!inbox->push(ev)) {
+      inbox->free_sysex(ev.sysex);
+      return false;
+    }
+    return true;
+  }
+
+  // Number of MIDI events dropped so far because the inbox was full.
+  unsigned midi_overflows()
+  {
+    return inbox->overflows.load(std::memory_order_relaxed);
+  }
+
+  // Fetch the pending MIDI events from the inbox. With sample-accurate
+  // processing, these are sorted into the event queue of the current block,
+  // otherwise they're processed right away.
+
+  void fetch_midi()
+  {
+    MidiEvent ev;
+#if FAUST_SAMPLE_ACCURATE
+    while (n_events < MIDI_QUEUE_SIZE && inbox->pop(ev)) {
+      // Keep the queue sorted by frame offsets. Hosts usually deliver the
+      // events in order, so this is cheap.
+      int k = n_events++;
+      while (k > 0 && events[k-1].frame > ev.frame) {
+	events[k] = events[k-1];
+	k--;
+      }
+      events[k] = ev;
+    }
+#else
+#if FAUST_XRUN
+    xrun_events = 0;
+#endif
+    while (inbox->pop(ev)) {
+      process_event(ev);
+#if FAUST_XRUN
+      xrun_events++;
+#endif
+    }
+#endif
+#if DEBUG_MIDI
+    unsigned overflows = midi_overflows();
+    if (overflows != midi_overflows_seen) {
+      logmsg("midi inbox overflow (%u events dropped)\n",
+	     overflows-midi_overflows_seen);
+      midi_overflows_seen = overflows;
+    }
+#endif
+  }
+
+#if FAUST_SAMPLE_ACCURATE && MIDI_COALESCE
+  // Drop controller, pitch bend and data entry messages from the event queue
+  // which are superseded by a later message of the same kind at the same
+  // frame offset. Notes and other messages which depend on the controller
+  // state act as barriers. The controls thus get the same values at the same
+  // frames as if all messages had been processed. Messages for smoothed
+  // controls are never dropped, since each of them restarts the ramp (see
+  // keep_ctrl above).
+
+  void coalesce_midi()
+  {
+    unsigned base = ev_seq, run = base;
+    unsigned n_ctrl = 0, n_bend = 0;
+    assert(ev_pos == 0);
+    for (int i = 0; i < n_events; i++) {
+      MidiEvent &ev = events[i];
+      unsigned seq = base+i, *last = NULL, lim;
+      if (i > 0 && ev.frame != events[i-1].frame)
+	run = seq; // new frame offset
+      if (ev.sysex >= 0) {
+	// tuning changes affect all channels
+	run = seq+1;
+	continue;
+      }
+      uint8_t status = ev.data[0] & 0xf0, chan = ev.data[0] & 0x0f;
+      lim = max(run, chan_barrier[chan]);
+      switch (status) {
+      case 0x80: case 0x90:
+	// voices pick up the controller state of the channel when they start,
+	// and stop following it when they're released; a new note may also
+	// steal a voice from another channel
+	run = seq+1;
+	break;
+      case 0xe0:
+	if (!keep_bend) last = &last_bend[chan];
+	break;
+      case 0xb0:
+	switch (ev.data[1]) {
+	case 120: case 121: case 123:
+	  chan_barrier[chan] = seq+1;
+	  break;
+	case 96: case 97: case 98: case 99: case 100: case 101:
+	  // increment/decrement and (N)RPN selection
+	  data_barrier[chan] = seq+1;
+	  break;
+	case 6: case 38:
+	  lim = max(lim, data_barrier[chan]);
+	  // fall through
+	default:
+	  if (!keep_ctrl[ev.data[1]&0x7f])
+	    last = &last_ctrl[chan][ev.data[1]&0x7f];
+	  break;
+	}
+	break;
+      default:
+	break;
+      }
+      if (!last) continue;
+      // Drop the previous message of this kind if it's still in scope. Sequence
+      // numbers may wrap around, so we also check that it's the right event.
+      unsigned k = *last-base;
+      if (*last >= lim && k < (unsigned)i &&
+	  events[k].sysex < 0 && events[k].data[0] == ev.data[0] &&
+	  (status == 0xe0 || events[k].data[1] == ev.data[1])) {
+	events[k].data[0] = 0;
+	if (status == 0xe0)
+	  n_bend++;
+	else
+	  n_ctrl++;
+      }
+      *last = seq;
+    }
+    ev_seq = base+n_events;
+    if (n_ctrl+n_bend == 0) return;
+    // Remove the dropped events from the queue.
+    int j = 0;
+    for (int i = 0; i < n_events; i++)
+      if (events[i].sysex >= 0 || events[i].data[0])
+	events[j++] = events[i];
+    n_events = j;
+    elided_ctrl.fetch_add(n_ctrl, std::memory_order_relaxed);
+    elided_bend.fetch_add(n_bend, std::memory_order_relaxed);
+#if DEBUG_MIDI
+    logmsg("midi coalesce: %u controller and %u pitch bend events "
+	   "elided\n", n_ctrl, n_bend);
+#endif
+  }
+
+  // Number of controller (including data entry) and pitch bend events elided
+  // so far by coalesce_midi().
+  unsigned midi_elided_ctrl()
+  {
+    return elided_ctrl.load(std::memory_order_relaxed);
+  }
+
+  unsigned midi_elided_bend()
+  {
+    return elided_bend.load(std::memory_order_relaxed);
+  }
+#endif
+
+  void process_event(MidiEvent &ev)
+  {
+    if (ev.sysex >= 0) {
+      MidiInbox::Sysex &buf = inbox->sysex[ev.sysex];
+      if (maxvoices > 0) process_sysex(buf.data, buf.len);
+      inbox->free_sysex(ev.sysex);
+    } else
+      process_midi(ev.data, 4);
   }
 
   // This processes just a single MIDI message, so to process an entire series
   // of MIDI events you'll have to loop over the event data in the plugin's
-  // MIDI callback. XXXTODO: Sample-accurate processing of MIDI events.
+  // MIDI callback. The message takes effect immediately; use push_midi()
+  // above to have it processed in the audio thread.
 
   void process_midi(unsigned char *data, int sz)
   {
 #if DEBUG_MIDI
-    fprintf(stderr, "midi ev (%d bytes):", sz);
+    logmsg("midi ev (%d bytes):", sz);
     for (int i = 0; i < sz; i++)
-      fprintf(stderr, " 0x%0x", data[i]);
-    fprintf(stderr, "\n");
+      logmsg(" 0x%0x", data[i]);
+    logmsg("\n");
 #endif
     uint8_t status = data[0] & 0xf0, chan = data[0] & 0x0f;
     bool is_instr = maxvoices > 0;
@@ -1357,8 +3971,8 @@ struct VSTPlugin {
       if (!is_instr) break;
       // note on
 #if DEBUG_NOTES
-      fprintf(stderr, "note-on  chan %d, note %d, vel %d\n", chan+1,
-	      data[1], data[2]);
+      logmsg("note-on  chan %d, note %d, vel %d\n", chan+1,
+	     data[1], data[2]);
 #endif
       if (data[2] == 0) goto note_off;
       alloc_voice(chan, data[1], data[2]);
@@ -1368,8 +3982,8 @@ struct VSTPlugin {
       if (!is_instr) break;
       // note off
 #if DEBUG_NOTES
-      fprintf(stderr, "note-off chan %d, note %d, vel %d\n", chan+1,
-	      data[1], data[2]);
+      logmsg("note-off chan %d, note %d, vel %d\n", chan+1,
+	     data[1], data[2]);
 #endif
       note_off:
       dealloc_voice(chan, data[1], data[2]);
@@ -1381,11 +3995,10 @@ struct VSTPlugin {
       // data[1] is LSB, data[2] MSB, range is 0..0x3fff (which maps to
       // -2..+2 semitones by default), center point is 0x2000 = 8192
       int val = data[1] | (data[2]<<7);
-      vd->bend[chan] =
-	(val-0x2000)/8192.0f*vd->range[chan];
+      set_bend(chan, (val-0x2000)/8192.0f*vd->range[chan]);
 #if DEBUG_MIDICC
-      fprintf(stderr, "pitch-bend (chan %d): %g cent\n", chan+1,
-	      vd->bend[chan]*100.0);
+      logmsg("pitch-bend (chan %d): %g cent\n", chan+1,
+	     vd->bend[chan]*100.0);
 #endif
       update_voices(chan);
       break;
@@ -1399,7 +4012,7 @@ struct VSTPlugin {
 	// the same in the current implementation)
 	all_notes_off(chan);
 #if DEBUG_MIDICC
-	fprintf(stderr, "all-notes-off (chan %d)\n", chan+1);
+	logmsg("all-notes-off (chan %d)\n", chan+1);
 #endif
 	break;
       case 121:
@@ -1407,8 +4020,11 @@ struct VSTPlugin {
 	// resets the RPN-related controllers)
 	data_msb[chan] = data_lsb[chan] = 0;
 	rpn_msb[chan] = rpn_lsb[chan] = 0x7f;
+#if FAUST_MIDICC
+	nrpn[chan] = false;
+#endif
 #if DEBUG_MIDICC
-	fprintf(stderr, "all-controllers-off (chan %d)\n", chan+1);
+	logmsg("all-controllers-off (chan %d)\n", chan+1);
 #endif
 	break;
       case 101: case 100:
@@ -1417,12 +4033,32 @@ struct VSTPlugin {
 	  rpn_msb[chan] = data[2];
 	else
 	  rpn_lsb[chan] = data[2];
+#if FAUST_MIDICC
+	nrpn[chan] = false;
+#endif
+	break;
+#if FAUST_MIDICC
+      case 99: case 98:
+	// NRPN MSB/LSB (these share the parameter number with the RPNs, the
+	// last parameter number selected wins)
+	if (data[1] == 99)
+	  rpn_msb[chan] = data[2];
+	else
+	  rpn_lsb[chan] = data[2];
+	nrpn[chan] = true;
 	break;
+#endif
       case 6: case 38:
 	// data entry coarse/fine
-	if (data[1] == 6)
+	if (data[1] == 6) {
 	  data_msb[chan] = data[2];
-	else
+#if FAUST_MIDICC
+	  // NRPN values are often sent as MSB only, so a new MSB clears the
+	  // LSB (for RPNs we keep the LSB, which is needed for the cents
+	  // value of the pitch bend range)
+	  if (nrpn[chan]) data_lsb[chan] = 0;
+#endif
+	} else
 	  data_lsb[chan] = data[2];
 	goto rpn;
       case 96: case 97:
@@ -1433,7 +4069,19 @@ struct VSTPlugin {
 	   behaviour depends on which RPN or NRPN is being modified, which
 	   is also rather confusing. Fortunately, as we only handle RPNs
 	   0..2 here anyway, it's sufficient to assume the MSB for RPN #2
-	   (channel coarse tuning) and the LSB otherwise. */
+	   (channel coarse tuning) and the LSB otherwise. For NRPNs, we
+	   treat the value as a single 14 bit number instead. */
+#if FAUST_MIDICC
+	if (nrpn[chan]) {
+	  int value = (data_msb[chan]<<7) | data_lsb[chan];
+	  if (data[1] == 96 && value < 0x3fff)
+	    value++;
+	  else if (data[1] == 97 && value > 0)
+	    value--;
+	  data_msb[chan] = value>>7;
+	  data_lsb[chan] = value&0x7f;
+	} else
+#endif
 	if (rpn_msb[chan] == 0 && rpn_lsb[chan] == 2) {
 	  // modify the MSB
 	  if (data[1] == 96 && data_msb[chan] < 0x7f)
@@ -1448,6 +4096,17 @@ struct VSTPlugin {
 	    data_lsb[chan]--;
 	}
       rpn:
+#if FAUST_MIDICC
+	if (nrpn[chan]) {
+	  // NRPNs are interpreted according to the MIDI controller map
+	  if (!nrpnmap) break;
+	  int num = (rpn_msb[chan]<<7) | rpn_lsb[chan];
+	  int value = (data_msb[chan]<<7) | data_lsb[chan];
+	  for (int t = nrpnmap[num]; t < nrpnmap[num+1]; t++)
+	    set_ctrl(chan, ctrltargets[t], value, "nrpn", num);
+	  break;
+	}
+#endif
 	if (!is_instr) break;
 	if (rpn_msb[chan] == 0) {
 	  switch (rpn_lsb[chan]) {
@@ -1457,8 +4116,8 @@ struct VSTPlugin {
 	    vd->range[chan] = data_msb[chan]+
 	      data_lsb[chan]/100.0;
 #if DEBUG_RPN
-	    fprintf(stderr, "pitch-bend-range (chan %d): %g cent\n", chan+1,
-		    vd->range[chan]*100.0);
+	    logmsg("pitch-bend-range (chan %d): %g cent\n", chan+1,
+		   vd->range[chan]*100.0);
 #endif
 	    break;
 	  case 1:
@@ -1477,9 +4136,10 @@ struct VSTPlugin {
 	    vd->tune[chan] = vd->coarse[chan]+
 	      vd->fine[chan];
 #if DEBUG_RPN
-	    fprintf(stderr, "master-tuning (chan %d): %g cent\n", chan+1,
-		    vd->tune[chan]*100.0);
+	    logmsg("master-tuning (chan %d): %g cent\n", chan+1,
+		   vd->tune[chan]*100.0);
 #endif
+	    update_pitch(chan);
 	    update_voices(chan);
 	    break;
 	  default:
@@ -1491,32 +4151,20 @@ struct VSTPlugin {
 #if FAUST_MIDICC
 	// interpret all other controller changes according to the MIDI
 	// controller map defined in the Faust plugin itself
-	std::map<uint8_t,int>::iterator it = ctrlmap.find(data[1]);
-	if (it != ctrlmap.end()) {
-	  // defined MIDI controller
-	  int j = inctrls[it->second],
-	    k = ui[0]->elems[j].port;
-	  float val = ctrlval(ui[0]->elems[j], data[2]);
-	  midivals[chan][k] = val;
-	  if (is_instr) {
-	    // instrument: update running voices on this channel
-	    for (boost::circular_buffer<int>::iterator it =
-		   vd->used_voices.begin();
-		 it != vd->used_voices.end(); it++) {
-	      int i = *it;
-	      if (vd->note_info[i].ch == chan)
-		*ui[i]->elems[j].zone = val;
-	    }
-	  } else {
-	    // simple effect: here we only have a single dsp instance and
-	    // we're operating in omni mode, so we just update the control no
-	    // matter what the midi channel is
-	    *ui[0]->elems[j].zone = val;
-	  }
-#if DEBUG_MIDICC
-	  fprintf(stderr, "ctrl-change chan %d, ctrl %d, val %d\n", chan+1,
-		  data[1], data[2]);
-#endif
+	int num = data[1] & 0x7f;
+	for (int t = ctrlmap[num]; t < ctrlmap[num+1]; t++)
+	  set_ctrl(chan, ctrltargets[t], data[2], "ctrl", num);
+	// 14 bit controllers: the MSB (controllers 0..31) is remembered and
+	// takes effect immediately, the LSB (controllers 32..63) is combined
+	// with the most recent MSB
+	if (num < 32) {
+	  ctrl14_msb[chan][num] = data[2];
+	  for (int t = ctrl14map[num]; t < ctrl14map[num+1]; t++)
+	    set_ctrl(chan, ctrltargets[t], data[2]<<7, "ctrl14", num);
+	} else if (num < 64) {
+	  int msb = num-32, value = (ctrl14_msb[chan][msb]<<7) | data[2];
+	  for (int t = ctrl14map[msb]; t < ctrl14map[msb+1]; t++)
+	    set_ctrl(chan, ctrltargets[t], value, "ctrl14", msb);
 	}
 #endif
 	break;
@@ -1529,16 +4177,49 @@ struct VSTPlugin {
     }
   }
 
+#if FAUST_MIDICC
+  // Update a control assigned to a MIDI controller or NRPN. The name and
+  // number of the controller are only used for debugging output.
+
+  void set_ctrl(uint8_t chan, const CtrlTarget &c, int v,
+		const char *what, int num)
+  {
+    int j = c.elem, k = c.port;
+    float val = ctrlval(c, v);
+    midivals[chan][k] = val;
+    if (maxvoices > 0) {
+      // instrument: update running voices on this channel
+      for (int i = vd->chan_voices[chan].head; i >= 0;
+	   i = vd->cnext[i]) {
+	sync_voice(i);
+	set_zone(i, j, val);
+      }
+    } else {
+      // simple effect: here we only have a single dsp instance and
+      // we're operating in omni mode, so we just update the control no
+      // matter what the midi channel is
+      sync_voice(0);
+      set_zone(0, j, val);
+    }
+#if DEBUG_MIDICC
+    logmsg("ctrl-change chan %d, %s %d, val %d -> %s = %g\n",
+	   chan+1, what, num, v, ui[0]->elems[j].label, val);
+#else
+    (void)what; (void)num;
+#endif
+  }
+#endif
+
   // Process an MTS sysex message and update the control values accordingly.
 
   void process_sysex(uint8_t *data, int sz)
   {
     if (!data || sz < 2) return;
 #if DEBUG_MIDI
-    fprintf(stderr, "midi sysex (%d bytes):", sz);
+    logmsg("midi sysex (%d bytes):", sz);
     for (int i = 0; i < sz; i++)
-      fprintf(stderr, " 0x%0x", data[i]);
-    fprintf(stderr, "\n");
+      logmsg(" 0x%0x", data[i]);
+    logmsg("\n");
 #endif
     if (data[0] == 0xf0) {
       // Skip over the f0 and f7 status bytes in case they are included in the
@@ -1564,6 +4245,9 @@ struct VSTPlugin {
 	    if (chanmsk & (1<<ch))
 	      vd->tuning[ch][i] = t;
 	}
+	for (uint8_t ch = 0; ch < 16; ch++)
+	  if (chanmsk & (1<<ch))
+	    update_pitch(ch);
 	if (realtime) {
 	  for (uint8_t ch = 0; ch < 16; ch++)
 	    if (chanmsk & (1<<ch)) {
@@ -1572,8 +4256,8 @@ struct VSTPlugin {
 	    }
 	}
 #if DEBUG_MTS
-	fprintf(stderr, "octave-tuning-%s (chan ",
-		realtime?"realtime":"non-realtime");
+	logmsg("octave-tuning-%s (chan ",
+	       realtime?"realtime":"non-realtime");
 	bool first = true;
 	for (uint8_t i = 0; i < 16; )
 	  if (chanmsk & (1<<i)) {
@@ -1583,28 +4267,28 @@ struct VSTPlugin {
 	    if (first)
 	      first = false;
 	    else
-	      fprintf(stderr, ",");
+	      logmsg(",");
 	    if (j > i+1)
-	      fprintf(stderr, "%u-%u", i+1, j);
+	      logmsg("%u-%u", i+1, j);
 	    else
-	      fprintf(stderr, "%u", i+1);
+	      logmsg("%u", i+1);
 	    i = j;
 	  } else
 	    i++;
-	fprintf(stderr, "):");
+	logmsg("):");
 	if (onebyte) {
 	  for (int i = 7; i < 19; i++) {
 	    int val = data[i];
-	    fprintf(stderr, " %d", val-64);
+	    logmsg(" %d", val-64);
 	  }
 	} else {
 	  for (int i = 7; i < 31; i++) {
 	    int val = data[i++] << 7;
 	    val |= data[i];
-	    fprintf(stderr, " %g", ((double)val-8192.0)/8192.0*100.0);
+	    logmsg(" %g", ((double)val-8192.0)/8192.0*100.0);
 	  }
 	}
-	fprintf(stderr, "\n");
+	logmsg("\n");
 #endif
       }
     }
@@ -1613,13 +4297,21 @@ struct VSTPlugin {
   // Change to a given preloaded tuning. The given tuning number may be in the
   // range 1..VSTPlugin::n_tunings, zero denotes the default tuning (equal
   // temperament). This is only supported if FAUST_MTS is defined at compile
-  // time.
+  // time. This modifies the voice data, so it must only be invoked on the
+  // audio thread. Other threads use request_tuning() instead, which makes the
+  // change take effect at the beginning of the next audio block.
+
+  void request_tuning(int num)
+  {
+    if (num < 0) num = 0;
+    tuning_req.store(num, std::memory_order_release);
+  }
 
   void change_tuning(int num)
   {
 #if FAUST_MTS
     if (!mts || num == tuning) return;
-    modified = true;
+    disp_pending = true;
     if (num < 0) num = 0;
     if (num > mts->tuning.size())
       num = mts->tuning.size();
@@ -1629,9 +4321,11 @@ struct VSTPlugin {
 		    mts->tuning[tuning-1].len);
     } else {
       memset(vd->tuning, 0, sizeof(vd->tuning));
+      for (uint8_t ch = 0; ch < 16; ch++)
+	update_pitch(ch);
 #if DEBUG_MTS
-      fprintf(stderr,
-	      "octave-tuning-default (chan 1-16): equal temperament\n");
+      logmsg(
+	     "octave-tuning-default (chan 1-16): equal temperament\n");
 #endif
 #endif
     }
@@ -1647,6 +4341,8 @@ MTSTunings *VSTPlugin::mts = 0;
 
 /* VST-specific part starts here. ********************************************/
 
+#if FAUST_VST
+
 #include "audioeffectx.h"
 #if FAUST_UI
 #include "faustvstqt.h"
@@ -1674,6 +4370,7 @@ public:
   virtual void suspend();
   virtual void resume();
   virtual void setSampleRate(float sampleRate);
+  virtual void setBlockSize(VstInt32 blockSize);
 
   virtual void setProgram(VstInt32 program);
   virtual void setProgramName(const char *name);
@@ -1896,6 +4593,12 @@ VSTWrapper::VSTWrapper(audioMasterCallback audioMaster)
 
 VSTWrapper::~VSTWrapper()
 {
+#if FAUST_PROFILE
+  plugin->profile_dump(stderr);
+#endif
+#if FAUST_XRUN
+  plugin->xrun_dump(stderr);
+#endif
   delete plugin;
   if (progdata) free(progdata);
 #if FAUST_UI
@@ -1923,6 +4626,12 @@ void VSTWrapper::setSampleRate(float sampleRate)
   plugin->set_rate(sampleRate);
 }
 
+void VSTWrapper::setBlockSize(VstInt32 blockSize)
+{
+  AudioEffect::setBlockSize(blockSize);
+  plugin->set_blocksize(blockSize);
+}
+
 // programs a.k.a. built-in presets (see above)
 
 void VSTWrapper::setProgram(VstInt32 prog)
@@ -1968,7 +4677,8 @@ VstInt32 VSTWrapper::getChunk(void** data, bool isPreset)
   int k = plugin->ui[0]->nports;
   // data for the k ports is already in plugin->ports, for instruments we also
   // add the values of the polyphony and (if enabled) the tuning control
-  memcpy(progdata, plugin->ports, k*sizeof(float));
+  for (int i = 0; i < k; i++)
+    progdata[i] = plugin->ports[i];
   if (plugin->maxvoices > 0) {
     progdata[k++] = plugin->poly;
 #if FAUST_MTS
@@ -1992,11 +4702,13 @@ VstInt32 VSTWrapper::setChunk(void* data, VstInt32 byteSize, bool isPreset)
   // copy the data over to the program storage
   if (progdata != data) memcpy(progdata, data, (k+m)*sizeof(float));
   // set the control data
-  memcpy(plugin->ports, progdata, k*sizeof(float));
+  for (int i = 0; i < k; i++)
+    plugin->ports[i] = progdata[i];
+  plugin->mark_dirty();
   if (plugin->maxvoices > 0) {
     plugin->poly = min(plugin->maxvoices, max(1, (int)progdata[k]));
 #if FAUST_MTS
-    plugin->change_tuning((int)progdata[k+1]);
+    plugin->request_tuning((int)progdata[k+1]);
 #endif
   }
   // Noone seems to know what the return value is good for. Just always
@@ -2069,14 +4781,14 @@ void VSTWrapper::getParameterDisplay(VstInt32 index, char *text)
   if (index < k) {
     int j = plugin->ctrls[index];
     assert(index == plugin->ui[0]->elems[j].port);
-    sprintf(text, "%0.5g", plugin->ports[index]);
+    sprintf(text, "%0.5g", plugin->ports[index].load());
   } else if (index == k && plugin->maxvoices > 0) {
-    sprintf(text, "%d voices", plugin->poly);
+    sprintf(text, "%d voices", plugin->poly.load());
 #if FAUST_MTS
   } else if (index == k+1 && plugin->n_tunings > 0) {
-    sprintf(text, "%d %s", plugin->tuning,
-	    plugin->tuning>0?plugin->mts->tuning[plugin->tuning-1].name:
-	    "default");
+    int tuning = plugin->tuning;
+    sprintf(text, "%d %s", tuning,
+	    tuning>0?plugin->mts->tuning[tuning-1].name:"default");
 #endif
   }
 }
@@ -2137,13 +4849,16 @@ void VSTWrapper::setParameter(VstInt32 index, float value)
     // We only need to update the port value here, the ui values are then
     // updated automatically as needed in the process_audio() callback.
     plugin->ports[index] = val;
+    plugin->mark_dirty(index);
   } else if (index == k && plugin->maxvoices > 0) {
-    plugin->poly = (int)quantize((value*plugin->maxvoices), 1);
-    if (plugin->poly <= 0) plugin->poly = 1;
+    // store the clamped value in one go, since the audio thread may pick it
+    // up at any time (see VSTPlugin::process_block)
+    int val = (int)quantize((value*plugin->maxvoices), 1);
+    plugin->poly = max(1, min(plugin->maxvoices, val));
 #if FAUST_MTS
   } else if (index == k+1 && plugin->n_tunings > 0) {
     int tuning = (int)quantize((value*plugin->mts->tuning.size()), 1);
-    plugin->change_tuning(tuning);
+    plugin->request_tuning(tuning);
 #endif
   }
 }
@@ -2172,6 +4887,7 @@ bool VSTWrapper::string2parameter(VstInt32 index, char *text)
     else if (val > max)
       val = max;
     plugin->ports[index] = val;
+    plugin->mark_dirty(index);
   } else if (index == k && plugin->maxvoices > 0) {
     int val = atoi(text);
     if (val <= 0) val = 1;
@@ -2180,7 +4896,7 @@ bool VSTWrapper::string2parameter(VstInt32 index, char *text)
 #if FAUST_MTS
   } else if (index == k+1 && plugin->mts &&
 	     plugin->mts->tuning.size() > 0) {
-    plugin->change_tuning(atoi(text));
+    plugin->request_tuning(atoi(text));
 #endif
   } else
     return false;
@@ -2267,11 +4983,25 @@ VstInt32 VSTWrapper::canDo(char *text)
 void VSTWrapper::processReplacing(float **inputs, float **outputs,
 				  VstInt32 n_samples)
 {
+#if FAUST_XRUN
+  uint64_t t0 = clock_ns();
+#endif
   plugin->process_audio(n_samples, inputs, outputs);
   // Some hosts may require this to force a GUI update of the controls.
   // XXXFIXME: Alas, some hosts don't seem to handle this at all (e.g.,
   // Tracktion).
+#if FAUST_PROFILE
+  if (plugin->modified) {
+    uint64_t t = clock_ns();
+    updateDisplay();
+    plugin->profile_host(clock_ns()-t);
+  }
+#else
   if (plugin->modified) updateDisplay();
+#endif
+#if FAUST_XRUN
+  plugin->xrun_check(n_samples, clock_ns()-t0);
+#endif
 }
 
 VstInt32 VSTWrapper::processEvents(VstEvents* events)
@@ -2281,29 +5011,22 @@ VstInt32 VSTWrapper::processEvents(VstEvents* events)
     if (events->events[i]->type == kVstMidiType) {
       VstMidiEvent* ev = (VstMidiEvent*)events->events[i];
       uint8_t *data = (uint8_t*)ev->midiData;
-#if 0
-      // FIXME: Consider doing sample-accurate note onsets here. VST keeps
-      // track of the exact onset in the deltaFrames field, but we can't use
-      // that information at present, since our gate parameter is a control
-      // variable which can only change at block boundaries. In the future,
-      // the gate could be implemented as an audio signal to get
-      // sample-accurate note onsets.
-      VstInt32 frames = ev->deltaFrames;
-#endif
 #if 0
       fprintf(stderr, "ev length = %d, offset = %d, detune = %d, off velocity = %d\n", ev->noteLength, ev->noteOffset, (int)(signed char)ev->detune, (int)ev->noteOffVelocity);
 #endif
-      plugin->process_midi(data, 4);
+      // The event takes effect at the given frame offset in the next block
+      // (see VSTPlugin::process_audio).
+      plugin->push_midi(ev->deltaFrames, data, 4);
     } else if (events->events[i]->type == kVstSysExType) {
       VstMidiSysexEvent* ev = (VstMidiSysexEvent*)events->events[i];
       int sz = ev->dumpBytes;
       uint8_t *data = (uint8_t*)ev->sysexDump;
       bool is_instr = plugin->maxvoices > 0;
       if (!is_instr) continue;
-      plugin->process_sysex(data, sz);
+      plugin->push_sysex(ev->deltaFrames, data, sz);
     } else {
-      fprintf(stderr, "%s: unknown event type %d\n",
-	      VSTPlugin::pluginName(), events->events[i]->type);
+      logmsg_rt("%s: unknown event type %d\n",
+		VSTPlugin::pluginName(), events->events[i]->type);
     }
   }
   return 1;
@@ -3434,3 +6157,5 @@ void VSTQtGUI::updateVST()
 }
 
 #endif // FAUST_UI
+
+#endif // FAUST_VST
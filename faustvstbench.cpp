@@ -0,0 +1,622 @@
+/************************************************************************
+ ************************************************************************
+    Headless benchmark host for faust-vst plugins.
+    ---------------------------------------------------------------------
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation; either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+ ************************************************************************
+ ************************************************************************/
+
+/* This is a small host stub which drives the VSTPlugin class of a Faust
+   plugin directly, without the VST SDK, in order to measure its performance
+   outside of a DAW. It must be compiled with the C++ source of the plugin
+   (as generated by faust with the faustvst.cpp architecture) given as
+   DSP_SOURCE, and with FAUST_VST=0, e.g.:
+
+   c++ -O3 -DFAUST_VST=0 -DDSP_SOURCE='"organ.cpp"' faustvstbench.cpp \
+       -o organ-bench -lpthread
+
+   The 'bench' target in the Makefile does this for all the examples. The
+   benchmark feeds a synthetic pattern of notes (instruments only), MIDI
+   controller, pitch bend and tuning sysex messages to the plugin, at random
+   frame offsets, and times each call of process_audio(), for each of the
+   given block sizes and voice counts. It reports the processing time per
+   sample, per voice and sample (counting only voices which are actually
+   computed, i.e., not dormant), and the distribution of block times.
+
+   The output of the first run (first voice count and block size) can also be
+   saved as a reference render (-s dir), or compared against a reference
+   render saved earlier (-g dir). This lets you check that changes to the
+   architecture or the compilation options don't change the audio. Since the
+   input is entirely deterministic, the same options must give bit-identical
+   output, unless the changes are expected to affect rounding, in which case
+   a tolerance in ULPs or dB can be given with -e. The maximum error is
+   reported along with the timing of the run, and the program exits with a
+   nonzero status if the error exceeds the tolerance.
+
+   Finally, -R runs a real-time safety check instead of the benchmark: The
+   plugin gets the same input as above, plus a storm of zero-length notes
+   (note-ons immediately followed by the corresponding note-offs) on all MIDI
+   channels, and the program counts the heap allocations made while MIDI
+   events are posted to the plugin and while it processes audio. It exits
+   with a nonzero status if there were any. (This intercepts malloc and
+   friends on glibc-based systems, elsewhere only the C++ operator new.) */
+
+#ifndef DSP_SOURCE
+#error "DSP_SOURCE must be defined (C++ source of the plugin)"
+#endif
+
+#include DSP_SOURCE
+
+#include <errno.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+#include <string>
+#include <vector>
+
+#if FAUST_VST
+#error "faustvstbench must be compiled with -DFAUST_VST=0"
+#endif
+
+// Benchmark parameters, see usage() below.
+static int rate = 48000;
+static double seconds = 10.0, warmup = 1.0;
+static int note_len = 500, chord = 0, ctrls_per_block = 4;
+static bool notes = true, ctrls = true;
+static bool rtcheck = false;
+#if FAUST_PROFILE
+static bool profile = false;
+#endif
+#if FAUST_XRUN
+static bool xruns = false;
+#endif
+static std::vector<int> blocksizes, voicecounts;
+// Reference renders (see above).
+static const char *savedir = NULL, *refdir = NULL;
+static double tol_ulp = 0, tol_db = 0;
+static bool tol_is_db = false;
+static int out_chans = 0;
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [options]\n\
+Options:\n\
+-b sizes   block sizes (comma-separated list, default: 64,256,1024)\n\
+-n counts  voice counts (comma-separated list, instruments only,\n\
+           default: the plugin's number of voices)\n\
+-r rate    sample rate (default: 48000)\n\
+-t secs    length of each run in seconds (default: 10)\n\
+-w secs    warm-up time before each run in seconds (default: 1)\n\
+-k notes   notes per chord (default: number of voices)\n\
+-l msecs   note (and chord) length in milliseconds (default: 500)\n\
+-c count   controller messages per block (default: 4)\n\
+-N         no notes\n\
+-C         no controller, pitch bend, sysex and parameter changes\n\
+-s dir     save a reference render of the first run in dir\n\
+-g dir     compare the first run with the reference render in dir\n\
+-e tol     tolerance for -g: 0 (bit-identical, default), N ulp or N dB\n\
+           (maximum error relative to full scale, e.g., -120dB)\n\
+-P         print the per-phase profile of each run (needs FAUST_PROFILE)\n\
+-X         print the deadline misses of each run (needs FAUST_XRUN)\n\
+-R         check for heap allocations during a zero-length note storm\n\
+           instead of running the benchmark\n\
+-h         print this message\n", prog);
+}
+
+static bool parse_list(const char *s, std::vector<int> &v)
+{
+  v.clear();
+  while (*s) {
+    char *end;
+    long x = strtol(s, &end, 10);
+    if (end == s || x <= 0) return false;
+    v.push_back((int)x);
+    s = end;
+    if (*s == ',') s++;
+  }
+  return !v.empty();
+}
+
+// Allocation counter for the real-time safety check (-R). Allocations are
+// counted on all threads while count_allocs is set.
+static std::atomic<bool> count_allocs(false);
+static std::atomic<long> n_allocs(0);
+
+static inline void count_alloc()
+{
+  if (count_allocs.load(std::memory_order_relaxed))
+    n_allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+void *__libc_memalign(size_t align, size_t n);
+
+void *malloc(size_t n)
+{ count_alloc(); return __libc_malloc(n); }
+void *calloc(size_t n, size_t size)
+{ count_alloc(); return __libc_calloc(n, size); }
+void *realloc(void *p, size_t n)
+{ count_alloc(); return __libc_realloc(p, n); }
+void *memalign(size_t align, size_t n)
+{ count_alloc(); return __libc_memalign(align, n); }
+void *aligned_alloc(size_t align, size_t n)
+{ count_alloc(); return __libc_memalign(align, n); }
+int posix_memalign(void **p, size_t align, size_t n)
+{
+  count_alloc();
+  *p = __libc_memalign(align, n);
+  return *p ? 0 : ENOMEM;
+}
+}
+#else
+void *operator new(size_t n)
+{
+  count_alloc();
+  void *p = malloc(n);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t n) { return operator new(n); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+#endif
+
+// A simple deterministic random number generator, so that all runs see the
+// same message pattern.
+static uint32_t rnd_state = 1;
+
+static inline uint32_t rnd(uint32_t n)
+{
+  rnd_state = rnd_state*1664525u + 1013904223u;
+  return (rnd_state >> 8) % n;
+}
+
+static inline double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// Synthetic MIDI input for one block. Notes are played as chords of the
+// given size, a new chord starting (and replacing the previous one) every
+// note_len msecs. Each chord is shifted by a random interval, so that voices
+// get reallocated. Controller messages go to a few common controllers on the
+// first MIDI channel at random frame offsets; the occasional pitch bend and
+// (instruments only) realtime octave tuning messages are thrown in as well.
+// Also, now and then one of the plugin's controls is set to a random value,
+// as the host would do it when automating a parameter.
+
+struct Pattern {
+  int frames;		// frames until the next chord
+  int nnotes;		// notes in the current chord
+  uint8_t held[128];	// notes in the current chord
+  int base;		// current chord root
+};
+
+static void gen_midi(VSTPlugin *p, Pattern &pat, int blocksz, int k)
+{
+  bool is_instr = p->maxvoices > 0;
+  if (notes && is_instr) {
+    while (pat.frames < blocksz) {
+      int frame = pat.frames;
+      for (int i = 0; i < pat.nnotes; i++) {
+	uint8_t msg[3] = { 0x80, pat.held[i], 64 };
+	p->push_midi(frame, msg, 3);
+      }
+      pat.base = 36 + (pat.base - 36 + 1 + rnd(11)) % 48;
+      pat.nnotes = k;
+      for (int i = 0; i < k; i++) {
+	// Stack the chord in alternating fourths and tritones.
+	pat.held[i] = (pat.base + i*5 + i/2) & 0x7f;
+	uint8_t msg[3] = { 0x90, pat.held[i], (uint8_t)(64+rnd(64)) };
+	p->push_midi(frame, msg, 3);
+      }
+      pat.frames += (int)((double)note_len*rate/1000);
+    }
+    pat.frames -= blocksz;
+  }
+  if (ctrls) {
+    static const uint8_t ccs[] = { 1, 2, 7, 10, 11, 71, 74 };
+    const int nccs = sizeof(ccs)/sizeof(ccs[0]);
+    for (int i = 0; i < ctrls_per_block; i++) {
+      uint8_t msg[3] = { 0xb0, ccs[rnd(nccs)], (uint8_t)rnd(128) };
+      p->push_midi(rnd(blocksz), msg, 3);
+    }
+    if (rnd(4) == 0) {
+      int bend = rnd(16384);
+      uint8_t msg[3] = { 0xe0, (uint8_t)(bend&0x7f), (uint8_t)(bend>>7) };
+      p->push_midi(rnd(blocksz), msg, 3);
+    }
+    if (is_instr && rnd(100) == 0) {
+      // realtime octave tuning (1-byte form), all channels
+      uint8_t msg[21] = { 0xf0, 0x7f, 0x7f, 8, 8, 0x03, 0x7f, 0x7f };
+      for (int i = 0; i < 12; i++)
+	msg[i+8] = 64-10+rnd(21);
+      msg[20] = 0xf7;
+      p->push_sysex(rnd(blocksz), msg, 21);
+    }
+    if (p->n_in > 0 && rnd(8) == 0) {
+      int j = p->inctrls[rnd(p->n_in)], k = p->ui[0]->elems[j].port;
+      float min = p->ui[0]->elems[j].min, max = p->ui[0]->elems[j].max;
+      p->ports[k] = min + (max-min)*rnd(1001)/1000.0f;
+      p->mark_dirty(k);
+    }
+  }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Run the benchmark for the given number of voices and block size. If out
+// is non-NULL, the output of the plugin is stored there (interleaved, with
+// out_chans channels).
+// Returns the average processing time per sample in nsecs.
+static double bench(int nvoices, int blocksz, std::vector<float> *out = NULL)
+{
+  VSTPlugin *p = new VSTPlugin(nvoices, rate);
+  const int n = p->dsp[0]->getNumInputs();
+  const int m = p->dsp[0]->getNumOutputs();
+  // Use all voices (the polyphony control defaults to half of them).
+  if (nvoices > 0) p->poly = nvoices;
+  p->set_blocksize(blocksz);
+  p->resume();
+  // Audio buffers. Effects get some noise as input.
+  std::vector<float> inbuf(n*blocksz), outbuf(m*blocksz);
+  std::vector<float*> inputs(n), outputs(m);
+  for (int i = 0; i < n; i++) inputs[i] = &inbuf[i*blocksz];
+  for (int i = 0; i < m; i++) outputs[i] = &outbuf[i*blocksz];
+  const int k = std::min(128, chord>0?chord:(nvoices>0?nvoices:1));
+  Pattern pat;
+  pat.frames = 0; pat.nnotes = 0; pat.base = 36;
+  rnd_state = 1;
+  const int nwarm = (int)(warmup*rate/blocksz);
+  const int nblocks = std::max(1, (int)(seconds*rate/blocksz));
+  std::vector<double> times(nblocks);
+  double total = 0, voice_frames = 0;
+  if (out) {
+    out_chans = m;
+    out->resize((size_t)(nwarm+nblocks)*blocksz*m);
+  }
+  for (int b = -nwarm; b < nblocks; b++) {
+    for (int i = 0; i < n*blocksz; i++)
+      inbuf[i] = (rnd(65536)-32768)/65536.0f;
+    gen_midi(p, pat, blocksz, k);
+    int v0 = p->active_voices();
+    double t0 = now_ns();
+    p->process_audio(blocksz, inputs.data(), outputs.data());
+    double t = now_ns()-t0;
+#if FAUST_XRUN
+    p->xrun_check(blocksz, (uint64_t)t);
+#endif
+    if (out) {
+      float *buf = &(*out)[(size_t)(b+nwarm)*blocksz*m];
+      for (int i = 0; i < blocksz; i++)
+	for (int j = 0; j < m; j++)
+	  buf[i*m+j] = outputs[j][i];
+    }
+#if FAUST_PROFILE
+    // Discard the profiling data of the warm-up phase.
+    if (b == -1) p->prof_reset = true;
+#endif
+#if FAUST_XRUN
+    if (b == -1) p->xrun_reset = true;
+#endif
+    if (b < 0) continue;
+    // Count voices which were active at either end of the block.
+    int v = std::max(v0, p->active_voices());
+    times[b] = t;
+    total += t;
+    voice_frames += (double)v*blocksz;
+  }
+  qsort(times.data(), nblocks, sizeof(double), cmp_double);
+  const double frames = (double)nblocks*blocksz;
+  const double deadline = 1e9*blocksz/rate;
+#define pct(q) (times[(int)((nblocks-1)*(q))]/1000)
+  printf("%6d %6d %9.2f %9.2f %7.1f %9.2f %9.2f %9.2f %9.2f %6.1f%%\n",
+	 nvoices, blocksz, total/frames,
+	 voice_frames>0?total/voice_frames:0.0, voice_frames/frames,
+	 pct(0.5), pct(0.9), pct(0.99), times[nblocks-1]/1000,
+	 100*times[nblocks-1]/deadline);
+#undef pct
+#if FAUST_PROFILE
+  if (profile) {
+    p->profile_dump(stdout);
+    printf("\n");
+  }
+#endif
+#if FAUST_XRUN
+  if (xruns) {
+    p->xrun_dump(stdout);
+    printf("\n");
+  }
+#endif
+  delete p;
+  return total/frames;
+}
+
+// Real-time safety check (see above). Returns true if no allocations were
+// made on the audio path.
+static bool check(int nvoices, int blocksz)
+{
+  VSTPlugin *p = new VSTPlugin(nvoices, rate);
+  const int n = p->dsp[0]->getNumInputs();
+  const int m = p->dsp[0]->getNumOutputs();
+  if (nvoices > 0) p->poly = nvoices;
+  p->set_blocksize(blocksz);
+  p->resume();
+  std::vector<float> inbuf(n*blocksz), outbuf(m*blocksz);
+  std::vector<float*> inputs(n), outputs(m);
+  for (int i = 0; i < n; i++) inputs[i] = &inbuf[i*blocksz];
+  for (int i = 0; i < m; i++) outputs[i] = &outbuf[i*blocksz];
+  const int k = std::min(128, chord>0?chord:(nvoices>0?nvoices:1));
+  Pattern pat;
+  pat.frames = 0; pat.nnotes = 0; pat.base = 36;
+  rnd_state = 1;
+  const int nblocks = std::max(1, (int)(seconds*rate/blocksz));
+  n_allocs = 0;
+  for (int b = 0; b < nblocks; b++) {
+    for (int i = 0; i < n*blocksz; i++)
+      inbuf[i] = (rnd(65536)-32768)/65536.0f;
+    count_allocs = true;
+    gen_midi(p, pat, blocksz, k);
+    for (int i = 0; i < 16; i++) {
+      int frame = rnd(blocksz);
+      uint8_t ch = rnd(16), note = rnd(128);
+      uint8_t on[3] = { (uint8_t)(0x90|ch), note, (uint8_t)(1+rnd(127)) };
+      uint8_t off[3] = { (uint8_t)(0x80|ch), note, 64 };
+      p->push_midi(frame, on, 3);
+      p->push_midi(frame, off, 3);
+    }
+    p->process_audio(blocksz, inputs.data(), outputs.data());
+    count_allocs = false;
+  }
+  long allocs = n_allocs;
+  delete p;
+  printf("%6d %6d %9ld  %s\n", nvoices, blocksz, allocs,
+	 allocs?"FAILED":"ok");
+  return allocs == 0;
+}
+
+// Reference renders are stored as WAV files (32 bit float, little endian host
+// assumed), so that they can also be listened to.
+
+static void put16(uint8_t *p, uint16_t x) { p[0] = x; p[1] = x>>8; }
+static void put32(uint8_t *p, uint32_t x)
+{ p[0] = x; p[1] = x>>8; p[2] = x>>16; p[3] = x>>24; }
+static uint32_t get32(const uint8_t *p)
+{ return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24); }
+
+static void wav_header(uint8_t *h, int chans, uint32_t frames)
+{
+  uint32_t bytes = frames*chans*4;
+  memcpy(h, "RIFF", 4); put32(h+4, 36+bytes);
+  memcpy(h+8, "WAVEfmt ", 8); put32(h+16, 16);
+  put16(h+20, 3);	// IEEE float
+  put16(h+22, chans); put32(h+24, rate); put32(h+28, rate*chans*4);
+  put16(h+32, chans*4); put16(h+34, 32);
+  memcpy(h+36, "data", 4); put32(h+40, bytes);
+}
+
+static bool save_wav(const char *name, int chans, const std::vector<float> &v)
+{
+  FILE *fp = fopen(name, "wb");
+  if (!fp) return false;
+  uint8_t h[44];
+  size_t frames = chans>0?v.size()/chans:0;
+  wav_header(h, chans, frames);
+  bool ok = fwrite(h, 1, 44, fp) == 44 &&
+    fwrite(v.data(), sizeof(float), v.size(), fp) == v.size();
+  return fclose(fp) == 0 && ok;
+}
+
+// Load a reference render saved with save_wav. We only check that the header
+// matches what we would write ourselves.
+static bool load_wav(const char *name, int chans, std::vector<float> &v)
+{
+  FILE *fp = fopen(name, "rb");
+  if (!fp) return false;
+  uint8_t h[44], h2[44];
+  bool ok = fread(h, 1, 44, fp) == 44;
+  if (ok) {
+    uint32_t frames = get32(h+40)/(4*(chans>0?chans:1));
+    wav_header(h2, chans, frames);
+    ok = memcmp(h, h2, 44) == 0;
+    if (ok) {
+      v.resize((size_t)frames*chans);
+      ok = fread(v.data(), sizeof(float), v.size(), fp) == v.size();
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+// Distance of two floats in units in the last place.
+static inline int64_t ulps(float x, float y)
+{
+  int32_t a, b;
+  memcpy(&a, &x, 4); memcpy(&b, &y, 4);
+  // Map the sign-magnitude representation to a monotonic integer scale.
+  int64_t u = a<0?(int64_t)INT32_MIN-a:a, v = b<0?(int64_t)INT32_MIN-b:b;
+  return u>v?u-v:v-u;
+}
+
+// Compare a render with the reference, print the result and return whether
+// the error is within tolerance.
+static bool compare(const std::vector<float> &out,
+		    const std::vector<float> &ref, double ns)
+{
+  double maxerr = 0;
+  int64_t maxulp = 0;
+  for (size_t i = 0; i < out.size(); i++) {
+    double err = fabs((double)out[i]-ref[i]);
+    // NaNs in only one of the renders count as an infinite error.
+    if (err != err && (out[i] == out[i] || ref[i] == ref[i]))
+      err = INFINITY;
+    if (err > maxerr) maxerr = err;
+    int64_t u = ulps(out[i], ref[i]);
+    if (u > maxulp) maxulp = u;
+  }
+  double db = maxerr>0?20*log10(maxerr):-INFINITY;
+  bool ok = tol_is_db?(maxerr == 0 || db <= tol_db):(maxulp <= tol_ulp);
+  if (maxerr == 0 && maxulp == 0)
+    printf("reference: identical, %.2f ns/smp: ok\n", ns);
+  else
+    printf("reference: max error %.3g (%.1f dB, %lld ulp), %.2f ns/smp: %s\n",
+	   maxerr, db, (long long)maxulp, ns, ok?"ok":"FAILED");
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+  blocksizes.push_back(64);
+  blocksizes.push_back(256);
+  blocksizes.push_back(1024);
+  while ((c = getopt(argc, argv, "b:n:r:t:w:k:l:c:NCs:g:e:PXRh")) != -1) {
+    switch (c) {
+    case 'b':
+      if (!parse_list(optarg, blocksizes)) {
+	fprintf(stderr, "%s: bad block sizes '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    case 'n':
+      if (!parse_list(optarg, voicecounts)) {
+	fprintf(stderr, "%s: bad voice counts '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    case 'r': rate = atoi(optarg); break;
+    case 't': seconds = atof(optarg); break;
+    case 'w': warmup = atof(optarg); break;
+    case 'k': chord = atoi(optarg); break;
+    case 'l': note_len = atoi(optarg); break;
+    case 'c': ctrls_per_block = atoi(optarg); break;
+    case 'N': notes = false; break;
+    case 'C': ctrls = false; break;
+    case 's': savedir = optarg; break;
+    case 'g': refdir = optarg; break;
+    case 'e': {
+      char *end;
+      double x = strtod(optarg, &end);
+      if (strcasecmp(end, "db") == 0) {
+	tol_is_db = true;
+	tol_db = x;
+      } else if (x >= 0 && (!*end || strcasecmp(end, "ulp") == 0)) {
+	tol_is_db = false;
+	tol_ulp = x;
+      } else {
+	fprintf(stderr, "%s: bad tolerance '%s'\n", argv[0], optarg);
+	return 1;
+      }
+      break;
+    }
+    case 'P':
+#if FAUST_PROFILE
+      profile = true; break;
+#else
+      fprintf(stderr, "%s: -P needs a build with -DFAUST_PROFILE=1\n",
+	      argv[0]);
+      return 1;
+#endif
+    case 'X':
+#if FAUST_XRUN
+      xruns = true; break;
+#else
+      fprintf(stderr, "%s: -X needs a build with -DFAUST_XRUN=1\n",
+	      argv[0]);
+      return 1;
+#endif
+    case 'R': rtcheck = true; break;
+    case 'h': usage(argv[0]); return 0;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (rate <= 0 || seconds <= 0 || warmup < 0 || note_len <= 0 ||
+      ctrls_per_block < 0 || chord < 0 || chord > 128) {
+    usage(argv[0]);
+    return 1;
+  }
+  const int num_voices = VSTPlugin::numVoices();
+  if (num_voices <= 0 || voicecounts.empty()) {
+    voicecounts.clear();
+    voicecounts.push_back(num_voices);
+  }
+  printf("%s (%s, %d Hz, %g secs)\n", VSTPlugin::pluginName(),
+	 num_voices>0?"instrument":"effect", rate, seconds);
+  if (rtcheck) {
+    bool ok = true;
+    printf("%6s %6s %9s\n", "voices", "block", "allocs");
+    for (size_t i = 0; i < voicecounts.size(); i++)
+      for (size_t j = 0; j < blocksizes.size(); j++)
+	ok = check(voicecounts[i], blocksizes[j]) && ok;
+    return ok?0:1;
+  }
+  printf("%6s %6s %9s %9s %7s %9s %9s %9s %9s %7s\n",
+	 "voices", "block", "ns/smp", "ns/v/smp", "active",
+	 "p50(us)", "p90(us)", "p99(us)", "max(us)", "max%");
+  std::vector<float> out;
+  double ref_ns = 0;
+  for (size_t i = 0; i < voicecounts.size(); i++)
+    for (size_t j = 0; j < blocksizes.size(); j++) {
+      bool first = i == 0 && j == 0 && (savedir || refdir);
+      double ns = bench(voicecounts[i], blocksizes[j], first?&out:NULL);
+      if (first) ref_ns = ns;
+    }
+  if (!savedir && !refdir) return 0;
+  // The reference render is named after the program, minus the -bench
+  // suffix added by the Makefile.
+  std::string name = argv[0];
+  size_t pos = name.find_last_of('/');
+  if (pos != std::string::npos) name.erase(0, pos+1);
+  pos = name.rfind("-bench");
+  if (pos != std::string::npos) name.erase(pos);
+  const int m = out_chans;
+  bool ok = true;
+  if (savedir) {
+    std::string fname = std::string(savedir) + "/" + name + ".wav";
+    if (save_wav(fname.c_str(), m, out))
+      printf("reference: saved as %s\n", fname.c_str());
+    else {
+      fprintf(stderr, "%s: error writing file\n", fname.c_str());
+      ok = false;
+    }
+  }
+  if (refdir) {
+    std::string fname = std::string(refdir) + "/" + name + ".wav";
+    std::vector<float> ref;
+    if (!load_wav(fname.c_str(), m, ref)) {
+      fprintf(stderr, "%s: cannot read reference render\n", fname.c_str());
+      ok = false;
+    } else if (ref.size() != out.size()) {
+      printf("reference: length mismatch (%lu vs. %lu frames), "
+	     "use the same options as for the reference: FAILED\n",
+	     (unsigned long)(out.size()/m), (unsigned long)(ref.size()/m));
+      ok = false;
+    } else
+      ok = compare(out, ref, ref_ns) && ok;
+  }
+  return ok?0:1;
+}
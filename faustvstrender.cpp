@@ -0,0 +1,539 @@
+/************************************************************************
+ ************************************************************************
+    Offline MIDI file renderer for faust-vst plugins.
+    ---------------------------------------------------------------------
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation; either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+ ************************************************************************
+ ************************************************************************/
+
+/* This is a minimal VST host which loads a compiled plugin, plays one or
+   more standard MIDI files through it and writes the output to WAV files, as
+   fast as possible. The MIDI events are passed to the plugin through
+   effProcessEvents with the proper deltaFrames, exactly as a real host would
+   do it, followed by processReplacing for each block, so this can be used to
+   reproduce a given workload offline and to measure the real-time factor of
+   a plugin. With -j, several files are rendered in parallel, each worker
+   thread running its own plugin instance.
+
+   Usage: faustvstrender [options] plugin.so file.mid ...
+
+   Each input file foo.mid is rendered to foo.wav (32 bit float), unless an
+   output file or directory is given with -o or -d. Note that this only works
+   with plugins which take MIDI input, i.e., instruments and effects with
+   MIDI controller assignments; audio inputs are fed with silence. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "pluginterfaces/vst2.x/aeffectx.h"
+
+using namespace std;
+
+// Options, see usage() below.
+static int rate = 48000, blocksz = 512, njobs = 1;
+static double tail = 2.0;
+static const char *outfile = NULL, *outdir = NULL;
+static bool quiet = false;
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [options] plugin file.mid ...\n\
+Options:\n\
+-r rate    sample rate (default: 48000)\n\
+-b size    block size (default: 512)\n\
+-t secs    extra time rendered after the last MIDI event (default: 2)\n\
+-o file    output file (only with a single MIDI file)\n\
+-d dir     output directory (default: same as the MIDI file)\n\
+-j n       number of files to render in parallel (default: 1)\n\
+-q         only print the summary\n\
+-h         print this message\n", prog);
+}
+
+/* Standard MIDI files. ******************************************************/
+
+// A MIDI event with its position in frames. Sysex messages are stored in the
+// file buffer of the Smf object, at offset sysex (-1 for ordinary messages).
+
+struct SmfEvent {
+  uint64_t tick;
+  double time;		// in seconds
+  uint8_t data[4];
+  int sz;
+  long sysex;
+  int tempo;		// usecs per quarter for tempo changes, 0 otherwise
+};
+
+static bool smf_event_less(const SmfEvent &a, const SmfEvent &b)
+{
+  return a.tick < b.tick;
+}
+
+struct Smf {
+  vector<uint8_t> buf;
+  vector<SmfEvent> events;
+  const char *err;
+  bool load(const char *name);
+private:
+  size_t pos;
+  bool need(size_t n) { return pos+n <= buf.size(); }
+  uint32_t get32()
+  {
+    uint32_t x = (buf[pos]<<24) | (buf[pos+1]<<16) | (buf[pos+2]<<8) | buf[pos+3];
+    pos += 4;
+    return x;
+  }
+  uint16_t get16()
+  {
+    uint16_t x = (buf[pos]<<8) | buf[pos+1];
+    pos += 2;
+    return x;
+  }
+  // Variable-length quantity, returns false if we run past end.
+  bool getvlq(size_t end, uint32_t &x)
+  {
+    x = 0;
+    for (int i = 0; i < 4; i++) {
+      if (pos >= end) return false;
+      uint8_t b = buf[pos++];
+      x = (x<<7) | (b&0x7f);
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  }
+  bool track(size_t end, uint64_t tick);
+};
+
+bool Smf::track(size_t end, uint64_t tick)
+{
+  uint8_t status = 0;
+  while (pos < end) {
+    uint32_t delta, len;
+    if (!getvlq(end, delta)) return false;
+    tick += delta;
+    if (pos >= end) return false;
+    SmfEvent ev;
+    ev.tick = tick; ev.time = 0;
+    ev.sz = 0; ev.sysex = -1; ev.tempo = 0;
+    uint8_t b = buf[pos];
+    if (b == 0xff) {
+      // meta event
+      if (pos+2 > end) return false;
+      uint8_t type = buf[pos+1];
+      pos += 2;
+      if (!getvlq(end, len) || pos+len > end) return false;
+      if (type == 0x51 && len == 3) {
+	ev.tempo = (buf[pos]<<16) | (buf[pos+1]<<8) | buf[pos+2];
+	if (ev.tempo > 0) events.push_back(ev);
+      }
+      pos += len;
+      if (type == 0x2f) break;	// end of track
+    } else if (b == 0xf0 || b == 0xf7) {
+      // sysex; the f7 form is an escape for arbitrary data, which we only
+      // pass on if it's a complete sysex message
+      pos++;
+      if (!getvlq(end, len) || pos+len > end) return false;
+      if (b == 0xf0) {
+	// The f0 byte isn't included in the data, so we put it right before
+	// the length bytes, which aren't needed anymore.
+	buf[pos-1] = 0xf0;
+	ev.sysex = pos-1; ev.sz = len+1;
+	events.push_back(ev);
+      } else if (len > 0 && buf[pos] == 0xf0) {
+	ev.sysex = pos; ev.sz = len;
+	events.push_back(ev);
+      }
+      pos += len;
+      status = 0;
+    } else {
+      // channel message, possibly with running status
+      if (b & 0x80) {
+	status = b;
+	pos++;
+      } else if (!status)
+	return false;
+      int n = ((status&0xf0) == 0xc0 || (status&0xf0) == 0xd0)?1:2;
+      if (pos+n > end) return false;
+      ev.data[0] = status;
+      ev.data[1] = buf[pos];
+      ev.data[2] = n>1?buf[pos+1]:0;
+      ev.data[3] = 0;
+      ev.sz = n+1;
+      pos += n;
+      events.push_back(ev);
+    }
+  }
+  return true;
+}
+
+bool Smf::load(const char *name)
+{
+  FILE *fp = fopen(name, "rb");
+  err = "cannot open file";
+  if (!fp) return false;
+  uint8_t tmp[4096];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), fp)) > 0)
+    buf.insert(buf.end(), tmp, tmp+n);
+  fclose(fp);
+  err = "not a standard MIDI file";
+  pos = 0;
+  if (!need(14) || memcmp(&buf[0], "MThd", 4)) return false;
+  pos = 4;
+  uint32_t hlen = get32();
+  if (hlen < 6 || !need(hlen)) return false;
+  size_t hend = pos+hlen;
+  int format = get16(), ntracks = get16();
+  uint16_t division = get16();
+  pos = hend;
+  err = "bad MIDI file";
+  if (format > 2 || division == 0) return false;
+  uint64_t start = 0;
+  for (int i = 0; i < ntracks && need(8); ) {
+    bool is_track = !memcmp(&buf[pos], "MTrk", 4);
+    pos += 4;
+    uint32_t len = get32();
+    if (!need(len)) return false;
+    size_t end = pos+len;
+    if (is_track) {
+      // Format 2 files have independent patterns which are played one after
+      // another.
+      if (format == 2 && !events.empty())
+	start = events.back().tick;
+      if (!track(end, start)) return false;
+      i++;
+    }
+    pos = end;
+  }
+  // Merge the tracks. The sort is stable so that simultaneous events keep
+  // their order in the file.
+  stable_sort(events.begin(), events.end(), smf_event_less);
+  // Convert ticks to seconds, applying the tempo map.
+  double spt;	// seconds per tick
+  int ppq = 0;
+  if (division & 0x8000) {
+    // SMPTE time
+    int fps = -(int8_t)(division>>8), tpf = division&0xff;
+    spt = 1.0/((fps==29?29.97:fps)*tpf);
+  } else {
+    ppq = division;
+    spt = 0.5/ppq;	// default tempo is 120 bpm
+  }
+  double time = 0;
+  uint64_t last = 0;
+  for (size_t i = 0; i < events.size(); i++) {
+    SmfEvent &ev = events[i];
+    time += (ev.tick-last)*spt;
+    last = ev.tick;
+    ev.time = time;
+    if (ev.tempo && ppq) spt = ev.tempo*1e-6/ppq;
+  }
+  return true;
+}
+
+/* VST host. *****************************************************************/
+
+typedef AEffect *(*PluginMain)(audioMasterCallback);
+
+static VstIntPtr host_callback(AEffect *effect, VstInt32 opcode,
+			       VstInt32 index, VstIntPtr value,
+			       void *ptr, float opt)
+{
+  switch (opcode) {
+  case audioMasterVersion:
+    return 2400;
+  default:
+    return 0;
+  }
+}
+
+static PluginMain plugin_main;
+// The plugin may keep some static data which is shared by all instances, so
+// we only create and destroy one instance at a time.
+static pthread_mutex_t plugin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static AEffect *open_plugin()
+{
+  pthread_mutex_lock(&plugin_mutex);
+  AEffect *effect = plugin_main(host_callback);
+  if (effect && effect->magic == kEffectMagic) {
+    effect->dispatcher(effect, effOpen, 0, 0, NULL, 0.0f);
+    effect->dispatcher(effect, effSetSampleRate, 0, 0, NULL, (float)rate);
+    effect->dispatcher(effect, effSetBlockSize, 0, blocksz, NULL, 0.0f);
+    effect->dispatcher(effect, effMainsChanged, 0, 1, NULL, 0.0f);
+  } else
+    effect = NULL;
+  pthread_mutex_unlock(&plugin_mutex);
+  return effect;
+}
+
+static void close_plugin(AEffect *effect)
+{
+  pthread_mutex_lock(&plugin_mutex);
+  effect->dispatcher(effect, effMainsChanged, 0, 0, NULL, 0.0f);
+  effect->dispatcher(effect, effClose, 0, 0, NULL, 0.0f);
+  pthread_mutex_unlock(&plugin_mutex);
+}
+
+/* WAV output (32 bit float, little endian host assumed). *******************/
+
+static void put16(uint8_t *p, uint16_t x) { p[0] = x; p[1] = x>>8; }
+static void put32(uint8_t *p, uint32_t x)
+{ p[0] = x; p[1] = x>>8; p[2] = x>>16; p[3] = x>>24; }
+
+static void wav_header(uint8_t *h, int chans, uint32_t frames)
+{
+  uint32_t bytes = frames*chans*4;
+  memcpy(h, "RIFF", 4); put32(h+4, 36+bytes);
+  memcpy(h+8, "WAVEfmt ", 8); put32(h+16, 16);
+  put16(h+20, 3);	// IEEE float
+  put16(h+22, chans); put32(h+24, rate); put32(h+28, rate*chans*4);
+  put16(h+32, chans*4); put16(h+34, 32);
+  memcpy(h+36, "data", 4); put32(h+40, bytes);
+}
+
+/* Rendering. ****************************************************************/
+
+struct Job {
+  string midifile, wavfile;
+  bool ok;
+  double secs, wall;	// audio length and wall-clock time
+};
+
+static vector<Job> jobs;
+static std::atomic<size_t> next_job(0);
+
+static inline double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static bool render(Job &job)
+{
+  Smf smf;
+  double t0 = now();
+  if (!smf.load(job.midifile.c_str())) {
+    fprintf(stderr, "%s: %s\n", job.midifile.c_str(), smf.err);
+    return false;
+  }
+  AEffect *effect = open_plugin();
+  if (!effect) {
+    fprintf(stderr, "%s: cannot create plugin instance\n",
+	    job.midifile.c_str());
+    return false;
+  }
+  FILE *fp = fopen(job.wavfile.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "%s: cannot open output file\n", job.wavfile.c_str());
+    close_plugin(effect);
+    return false;
+  }
+  const int n = effect->numInputs, m = effect->numOutputs;
+  const size_t nev = smf.events.size();
+  const uint64_t nframes = (uint64_t)llround(((nev?smf.events.back().time:0)+tail)*rate);
+  vector<float> inbuf((size_t)n*blocksz), outbuf((size_t)m*blocksz);
+  vector<float> wavbuf((size_t)m*blocksz);
+  vector<float*> inputs(n), outputs(m);
+  for (int i = 0; i < n; i++) inputs[i] = &inbuf[(size_t)i*blocksz];
+  for (int i = 0; i < m; i++) outputs[i] = &outbuf[(size_t)i*blocksz];
+  // VST event buffers, large enough for the densest block.
+  size_t maxev = 0;
+  for (size_t i = 0, j = 0; i < nev; i = j) {
+    uint64_t b = (uint64_t)llround(smf.events[i].time*rate)/blocksz;
+    for (j = i; j < nev && (uint64_t)llround(smf.events[j].time*rate)/blocksz == b; j++) ;
+    maxev = max(maxev, j-i);
+  }
+  vector<VstMidiEvent> midiev(maxev);
+  vector<VstMidiSysexEvent> sysexev(maxev);
+  vector<char> evbuf(sizeof(VstEvents)+maxev*sizeof(VstEvent*));
+  VstEvents *vstev = (VstEvents*)&evbuf[0];
+  uint8_t header[44];
+  wav_header(header, m, 0);
+  bool ok = fwrite(header, 1, 44, fp) == 44;
+  size_t k = 0;
+  for (uint64_t pos = 0; ok && pos < nframes; pos += blocksz) {
+    const int len = (int)min((uint64_t)blocksz, nframes-pos);
+    int ne = 0;
+    for (; k < nev; k++) {
+      const SmfEvent &ev = smf.events[k];
+      if (ev.tempo) continue;
+      uint64_t frame = (uint64_t)llround(ev.time*rate);
+      if (frame >= pos+len) break;
+      if (ev.sysex >= 0) {
+	VstMidiSysexEvent &e = sysexev[ne];
+	memset(&e, 0, sizeof(e));
+	e.type = kVstSysExType;
+	e.byteSize = sizeof(e);
+	e.deltaFrames = (VstInt32)(frame-pos);
+	e.dumpBytes = ev.sz;
+	e.sysexDump = (char*)&smf.buf[ev.sysex];
+	vstev->events[ne++] = (VstEvent*)&e;
+      } else {
+	VstMidiEvent &e = midiev[ne];
+	memset(&e, 0, sizeof(e));
+	e.type = kVstMidiType;
+	e.byteSize = sizeof(e);
+	e.deltaFrames = (VstInt32)(frame-pos);
+	memcpy(e.midiData, ev.data, 4);
+	vstev->events[ne++] = (VstEvent*)&e;
+      }
+    }
+    if (ne > 0) {
+      vstev->numEvents = ne;
+      vstev->reserved = 0;
+      effect->dispatcher(effect, effProcessEvents, 0, 0, vstev, 0.0f);
+    }
+    effect->processReplacing(effect, inputs.data(), outputs.data(), len);
+    for (int i = 0; i < len; i++)
+      for (int j = 0; j < m; j++)
+	wavbuf[i*m+j] = outputs[j][i];
+    ok = fwrite(wavbuf.data(), sizeof(float)*m, len, fp) == (size_t)len;
+  }
+  close_plugin(effect);
+  // Fill in the final sizes.
+  wav_header(header, m, (uint32_t)nframes);
+  ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(header, 1, 44, fp) == 44;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "%s: error writing file\n", job.wavfile.c_str());
+    return false;
+  }
+  job.secs = (double)nframes/rate;
+  job.wall = now()-t0;
+  return true;
+}
+
+static void *worker(void *data)
+{
+  size_t i;
+  while ((i = next_job.fetch_add(1)) < jobs.size()) {
+    Job &job = jobs[i];
+    job.ok = render(job);
+    if (job.ok && !quiet)
+      printf("%s -> %s: %.2f secs in %.3f secs (RTF %.4f)\n",
+	     job.midifile.c_str(), job.wavfile.c_str(), job.secs, job.wall,
+	     job.wall/job.secs);
+  }
+  return NULL;
+}
+
+static string wav_name(const char *midifile)
+{
+  string name = midifile;
+  size_t p = name.find_last_of('/');
+  if (outdir) name = string(outdir) + "/" +
+		(p==string::npos?name:name.substr(p+1));
+  p = name.find_last_of('.');
+  if (p != string::npos && name.find('/', p) == string::npos)
+    name.erase(p);
+  return name + ".wav";
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+  while ((c = getopt(argc, argv, "r:b:t:o:d:j:qh")) != -1) {
+    switch (c) {
+    case 'r': rate = atoi(optarg); break;
+    case 'b': blocksz = atoi(optarg); break;
+    case 't': tail = atof(optarg); break;
+    case 'o': outfile = optarg; break;
+    case 'd': outdir = optarg; break;
+    case 'j': njobs = atoi(optarg); break;
+    case 'q': quiet = true; break;
+    case 'h': usage(argv[0]); return 0;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (argc-optind < 2 || rate <= 0 || blocksz <= 0 || tail < 0 ||
+      njobs <= 0 || (outfile && argc-optind > 2)) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Load the plugin. On OS X, the plugin is a bundle and the shared library
+  // is at the usual place inside.
+  string plugin = argv[optind];
+  struct stat st;
+  if (stat(plugin.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    string base = plugin;
+    while (!base.empty() && base[base.size()-1] == '/')
+      base.erase(base.size()-1);
+    size_t p = base.find_last_of('/');
+    base = base.substr(p==string::npos?0:p+1);
+    p = base.find_last_of('.');
+    if (p != string::npos) base.erase(p);
+    plugin += "/Contents/MacOS/" + base;
+  } else if (plugin.find('/') == string::npos)
+    plugin = "./" + plugin;
+  void *handle = dlopen(plugin.c_str(), RTLD_NOW|RTLD_LOCAL);
+  if (!handle) {
+    fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+    return 1;
+  }
+  plugin_main = (PluginMain)dlsym(handle, "VSTPluginMain");
+  if (!plugin_main) plugin_main = (PluginMain)dlsym(handle, "main");
+  if (!plugin_main) {
+    fprintf(stderr, "%s: %s: not a VST plugin\n", argv[0], argv[optind]);
+    return 1;
+  }
+  for (int i = optind+1; i < argc; i++) {
+    Job job;
+    job.midifile = argv[i];
+    job.wavfile = outfile?string(outfile):wav_name(argv[i]);
+    job.ok = false;
+    job.secs = job.wall = 0;
+    jobs.push_back(job);
+  }
+  // Render.
+  double t0 = now();
+  njobs = min(njobs, (int)jobs.size());
+  vector<pthread_t> threads(njobs);
+  int nthreads = 0;
+  for (int i = 1; i < njobs; i++)
+    if (pthread_create(&threads[nthreads], NULL, worker, NULL) == 0)
+      nthreads++;
+  worker(NULL);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  double wall = now()-t0, secs = 0, cpu = 0;
+  int nfailed = 0;
+  for (size_t i = 0; i < jobs.size(); i++)
+    if (jobs[i].ok) {
+      secs += jobs[i].secs;
+      cpu += jobs[i].wall;
+    } else
+      nfailed++;
+  if (secs > 0)
+    printf("%d file(s), %.2f secs rendered in %.3f secs (%d job(s)): "
+	   "RTF %.4f per job, %.1fx real time overall\n",
+	   (int)jobs.size()-nfailed, secs, wall, nthreads+1,
+	   cpu/secs, secs/wall);
+  dlclose(handle);
+  return nfailed?1:0;
+}